@@ -0,0 +1,74 @@
+/* arena.c - aligned blocks of memory that engine state is carved out of */
+#include "arena.h"
+#include <sys/mman.h>
+
+static int huge_pages = 0;      // set by arena_huge_pages
+
+// bytes a piece takes up in an arena
+size_t arena_round(size_t bytes)
+{
+    return bytes + (ARENA_ALIGN - bytes % ARENA_ALIGN) % ARENA_ALIGN;
+}
+
+// back arenas of ARENA_HUGE or more with huge pages from now on
+void arena_huge_pages(int enable)
+{
+    huge_pages = enable;
+}
+
+// map a zeroed arena that can hand out size bytes
+/*  The ARENA itself sits at the start of the mapping. Huge pages are taken
+    from the reserved pool if there is one, and asked for from transparent
+    huge pages otherwise; either way the arena still works on small pages. */
+ARENA* new_arena(size_t size)
+{
+    size_t header = arena_round(sizeof(ARENA));
+    size_t length = header + arena_round(size);
+    void* base = MAP_FAILED;
+    ARENA* arena;
+
+    if(huge_pages && length >= ARENA_HUGE){
+#ifdef MAP_HUGETLB
+        size_t rounded = length + (ARENA_HUGE - length % ARENA_HUGE) % ARENA_HUGE;
+        base = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(base != MAP_FAILED)
+            length = rounded;
+#endif
+    }
+    if(base == MAP_FAILED){
+        base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(base == MAP_FAILED)
+            return NULL;
+#ifdef MADV_HUGEPAGE
+        if(huge_pages && length >= ARENA_HUGE)
+            madvise(base, length, MADV_HUGEPAGE);
+#endif
+    }
+
+    arena = (ARENA*)base;
+    arena->base = (unsigned char*)base + header;
+    arena->size = length - header;
+    arena->used = 0;
+    arena->length = length;
+    return arena;
+}
+
+// take a zeroed, cache-line aligned piece of the arena
+void* arena_alloc(ARENA* arena, size_t bytes)
+{
+    void* piece;
+
+    bytes = arena_round(bytes);
+    if(arena == NULL || bytes > arena->size - arena->used)
+        return NULL;
+    piece = arena->base + arena->used;
+    arena->used += bytes;
+    return piece;
+}
+
+// give the whole arena back
+void destroy_arena(ARENA* arena)
+{
+    if(arena)
+        munmap(arena, arena->length);
+}
@@ -0,0 +1,26 @@
+#include <stddef.h>
+
+#define ARENA_ALIGN (64)                // cache line every piece of an arena starts on
+#define ARENA_HUGE (2UL << 20)          // size of a huge page, and the smallest arena put on them
+
+// one block of memory that an engine's state is carved out of up front
+/*  Every piece starts on its own cache line, so state written by different
+    threads never shares one, and the whole arena goes back in one go. */
+typedef struct arena
+{
+    unsigned char* base;        // first byte that can be handed out
+    size_t size;                // bytes that can be handed out
+    size_t used;                // bytes handed out so far
+    size_t length;              // bytes mapped, the arena itself included
+} ARENA;
+
+// bytes a piece takes up in an arena (add these up to size one)
+size_t arena_round(size_t bytes);
+// back arenas of ARENA_HUGE or more with huge pages from now on, where the system has them
+void arena_huge_pages(int enable);
+// map a zeroed arena that can hand out size bytes (NULL on failure)
+ARENA* new_arena(size_t size);
+// take a zeroed, cache-line aligned piece of the arena (NULL if it's used up)
+void* arena_alloc(ARENA* arena, size_t bytes);
+// give the whole arena back
+void destroy_arena(ARENA* arena);
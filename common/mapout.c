@@ -0,0 +1,273 @@
+/* mapout.c - output files rendered straight into a memory mapping */
+#include "mapout.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static void put16(unsigned char* p, unsigned int value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+}
+
+static void put32(unsigned char* p, unsigned long value)
+{
+    put16(p,value & 0xFFFF);
+    put16(p + 2,(value >> 16) & 0xFFFF);
+}
+
+static unsigned int get16(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned long get32(const unsigned char* p)
+{
+    return get16(p) | ((unsigned long)get16(p + 2) << 16);
+}
+
+// size of the WAV header, padded with a JUNK chunk so the first frame is aligned
+static size_t wav_header_size(int pcm)
+{
+    size_t chunks = 12 + (pcm ? 8 + 16 : 8 + 18 + 12);     // RIFF, fmt (and fact for floats)
+    size_t size = chunks + 8 + 8;                           // the JUNK and data chunk headers
+    return size + (MAP_ALIGN - size % MAP_ALIGN) % MAP_ALIGN;
+}
+
+// write the WAV header for the given number of samples
+static void wav_header(MAPOUT* out, long samples)
+{
+    unsigned char* h = out->base;
+    int bytes = out->pcm ? sizeof(short) : sizeof(float);
+    unsigned long data = (unsigned long)samples * bytes;
+    size_t pos = 12;
+
+    memcpy(h,"RIFF",4);
+    put32(h + 4,out->header - 8 + data);
+    memcpy(h + 8,"WAVE",4);
+
+    memcpy(h + pos,"fmt ",4);
+    put32(h + pos + 4,out->pcm ? 16 : 18);
+    put16(h + pos + 8,out->pcm ? 1 : 3);            // WAVE_FORMAT_PCM or WAVE_FORMAT_IEEE_FLOAT
+    put16(h + pos + 10,out->channels);
+    put32(h + pos + 12,out->samplerate);
+    put32(h + pos + 16,(unsigned long)out->samplerate * bytes * out->channels);
+    put16(h + pos + 20,bytes * out->channels);
+    put16(h + pos + 22,bytes * 8);
+    if(out->pcm){
+        pos += 8 + 16;
+    } else {
+        put16(h + pos + 24,0);
+        pos += 8 + 18;
+        // non-PCM WAVs carry the frame count in a fact chunk
+        memcpy(h + pos,"fact",4);
+        put32(h + pos + 4,4);
+        put32(h + pos + 8,samples / out->channels);
+        pos += 12;
+    }
+
+    memcpy(h + pos,"JUNK",4);
+    put32(h + pos + 4,out->header - pos - 16);
+    memset(h + pos + 8,0,out->header - pos - 16);
+
+    memcpy(h + out->header - 8,"data",4);
+    put32(h + out->header - 4,data);
+}
+
+// check that a WAV already in the file has the layout out would give it (returns 0 if it does)
+/*  Carrying on into a file means writing frames where this header puts
+    them, so a file with a header of another size or a different format
+    (one libsndfile wrote, say) would come out scrambled. */
+static int wav_check(MAPOUT* out)
+{
+    unsigned char* h = (unsigned char*)malloc(out->header);
+    int bytes = out->pcm ? sizeof(short) : sizeof(float);
+    int format = 0;
+    size_t pos = 12;
+
+    if(h == NULL || pread(out->fd,h,out->header,0) != (ssize_t)out->header
+       || memcmp(h,"RIFF",4) != 0 || memcmp(h + 8,"WAVE",4) != 0){
+        free(h);
+        return 1;
+    }
+    // walk the chunks up to the data, which has to start where out puts the first frame
+    while(pos + 8 <= out->header){
+        unsigned long size = get32(h + pos + 4);
+        if(memcmp(h + pos,"fmt ",4) == 0 && size >= 16 && pos + 8 + 16 <= out->header){
+            format = get16(h + pos + 8) == (out->pcm ? 1 : 3)
+                     && (int)get16(h + pos + 10) == out->channels
+                     && (long)get32(h + pos + 12) == out->samplerate
+                     && (int)get16(h + pos + 22) == bytes * 8;
+        } else if(memcmp(h + pos,"data",4) == 0){
+            break;
+        }
+        pos += 8 + size + (size & 1);
+    }
+    free(h);
+    return !(format && pos == out->header - 8);
+}
+
+// open and map an output file, keeping the first kept samples of what it holds (-1 to start afresh)
+static MAPOUT* map_open(const char* path, const SF_INFO* info, long samples, long kept)
+{
+    int type = info->format & SF_FORMAT_TYPEMASK;
+    int subtype = info->format & SF_FORMAT_SUBMASK;
+    int endian = info->format & SF_FORMAT_ENDMASK;
+    unsigned short probe = 1;
+    int bytes;
+    MAPOUT* out;
+
+    // samples go into the mapping in the machine's own byte order, which has to be little-endian
+    if(*(unsigned char*)&probe != 1 || endian == SF_ENDIAN_BIG)
+        return NULL;
+    if(type != SF_FORMAT_WAV && type != SF_FORMAT_RAW)
+        return NULL;
+    if(subtype != SF_FORMAT_PCM_16 && subtype != SF_FORMAT_FLOAT)
+        return NULL;
+    if(samples < 1)
+        return NULL;
+
+    out = (MAPOUT*)calloc(1,sizeof(MAPOUT));
+    if(out == NULL)
+        return NULL;
+    out->fd = -1;
+    out->wav = (type == SF_FORMAT_WAV);
+    out->pcm = (subtype == SF_FORMAT_PCM_16);
+    out->channels = info->channels;
+    out->samplerate = info->samplerate;
+    out->capacity = samples;
+    out->header = out->wav ? wav_header_size(out->pcm) : 0;
+    bytes = out->pcm ? sizeof(short) : sizeof(float);
+    out->length = out->header + (size_t)samples * bytes;
+    // the RIFF sizes are 32 bits
+    if(out->wav && out->length - 8 > 0xFFFFFFFFUL)
+        goto fail;
+
+    if(kept < 0){
+        out->fd = open(path,O_RDWR | O_CREAT | O_TRUNC,0644);
+    } else {
+        // the samples that are being kept have to be there already
+        struct stat st;
+        out->fd = open(path,O_RDWR);
+        if(out->fd >= 0 && (fstat(out->fd,&st) || (size_t)st.st_size < out->header + (size_t)kept * bytes
+                            || (out->wav && wav_check(out)))){
+            close(out->fd);
+            out->fd = -1;
+        }
+    }
+    if(out->fd < 0)
+        goto fail;
+    // reserve the blocks now, so running out of disk is an error here and not a crash later
+    errno = posix_fallocate(out->fd,0,out->length);
+    if(errno == EINVAL || errno == EOPNOTSUPP){
+        if(ftruncate(out->fd,out->length))
+            goto fail;
+    } else if(errno){
+        goto fail;
+    }
+    out->base = (unsigned char*)mmap(NULL,out->length,PROT_READ | PROT_WRITE,MAP_SHARED,out->fd,0);
+    if(out->base == MAP_FAILED){
+        out->base = NULL;
+        goto fail;
+    }
+    madvise(out->base,out->length,MADV_SEQUENTIAL);
+    if(out->wav)
+        wav_header(out,samples);
+    return out;
+
+fail:
+    if(out->fd >= 0){
+        close(out->fd);
+        if(kept < 0)
+            unlink(path);
+    }
+    free(out);
+    return NULL;
+}
+
+// create, preallocate and map an output file with room for the given number of samples
+MAPOUT* map_output(const char* path, const SF_INFO* info, long samples)
+{
+    return map_open(path,info,samples,-1);
+}
+
+// map an output file again to carry on writing it after the first kept samples
+MAPOUT* map_reopen(const char* path, const SF_INFO* info, long samples, long kept)
+{
+    return map_open(path,info,samples,kept);
+}
+
+// make the first samples of the output and a header for them safe on disk
+int map_sync(MAPOUT* out, long samples)
+{
+    size_t length;
+
+    if(samples > out->capacity)
+        samples = out->capacity;
+    length = out->header + (size_t)samples * (out->pcm ? sizeof(short) : sizeof(float));
+    if(out->wav)
+        wav_header(out,samples);
+    return msync(out->base,length,MS_SYNC) != 0;
+}
+
+// where a float output stores the sample at position
+float* map_frames(MAPOUT* out, long position)
+{
+    if(out->pcm || position >= out->capacity)
+        return NULL;
+    return (float*)(out->base + out->header) + position;
+}
+
+// store count samples starting at position, converting them if needed
+/*  Frames already rendered in place (from map_frames) are only counted, so
+    every write into the mapping can be checked the same way. */
+long map_write(MAPOUT* out, const float* frames, long position, long count)
+{
+    if(position + count > out->capacity)
+        count = out->capacity - position;
+    if(count <= 0)
+        return 0;
+    if(out->pcm){
+        short* dest = (short*)(out->base + out->header) + position;
+        for(long i = 0; i < count; i++){
+            // the same scaling and clipping libsndfile writes 16-bit with
+            float value = frames[i] * 32767.0f;
+            if(value > 32767.0f) value = 32767.0f;
+            if(value < -32768.0f) value = -32768.0f;
+            dest[i] = (short)lrintf(value);
+        }
+    } else {
+        float* dest = map_frames(out,position);
+        if(dest != frames)
+            memcpy(dest,frames,sizeof(float) * count);
+    }
+    return count;
+}
+
+// fix up the header for the samples actually written, trim the file and close it
+int unmap_output(MAPOUT* out, long samples)
+{
+    int error = 0;
+    size_t length;
+
+    if(out == NULL)
+        return 0;
+    if(samples > out->capacity)
+        samples = out->capacity;
+    length = out->header + (size_t)samples * (out->pcm ? sizeof(short) : sizeof(float));
+    if(out->wav)
+        wav_header(out,samples);
+    munmap(out->base,out->length);
+    if(ftruncate(out->fd,length))
+        error++;
+    if(close(out->fd))
+        error++;
+    free(out);
+    return error;
+}
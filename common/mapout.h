@@ -0,0 +1,34 @@
+#include <stddef.h>
+#include <sndfile.h>
+
+#define MAP_ALIGN (64)          // byte boundary the first frame of a mapped WAV lands on
+
+// an output file written through a memory mapping instead of libsndfile
+typedef struct mapped_output
+{
+    int fd;                     // the open output file
+    unsigned char* base;        // start of the mapping (the file header comes first)
+    size_t length;              // bytes mapped
+    size_t header;              // bytes before the first frame
+    long capacity;              // most samples the mapping has room for
+
+    int wav;                    // write a WAV header (raw otherwise)
+    int pcm;                    // frames are 16-bit (floats otherwise)
+    int channels;
+    int samplerate;
+} MAPOUT;
+
+// (positions and counts are in samples, like the sf_read/write_float calls)
+
+// create, preallocate and map an output file with room for samples (NULL if the format can't be mapped)
+MAPOUT* map_output(const char* path, const SF_INFO* info, long samples);
+// map an output file again to carry on writing it after the first kept samples (NULL if they aren't there)
+MAPOUT* map_reopen(const char* path, const SF_INFO* info, long samples, long kept);
+// make the first samples of the output and a header for them safe on disk (returns 0 on success)
+int map_sync(MAPOUT* out, long samples);
+// where a float output stores the sample at position (NULL for 16-bit outputs)
+float* map_frames(MAPOUT* out, long position);
+// store count samples starting at position, converting them if needed (returns the number stored)
+long map_write(MAPOUT* out, const float* frames, long position, long count);
+// fix up the header for the samples actually written, trim the file and close it
+int unmap_output(MAPOUT* out, long samples);
@@ -8,11 +8,14 @@
 #include <sndfile.h>
 #include <time.h>
 #include <math.h>
+#include <string.h>
 #include "shatter_dat.h"
 
 #define NFRAMES (1024)      // defines the size of the read/write buffer
 #define DEFAULTMIN (62.0)   // the default minimum shard size (62ms)
 #define DEFAULTMAX (495.0)  // for an override the default maximum is the full size of the track
+#define PLANBLOCKS (64)     // blocks each thread renders per pass when rendering from a plan
+#define CHECKPOINTSECS (60) // default time between checkpoints (in seconds)
 
 enum arg_list {ARG_PROGNAME,ARG_INFILE,ARG_OUTFILE,ARG_LENGTH,ARG_LAYERS,ARG_NARGS};
 
@@ -23,18 +26,29 @@ int main(int argc, char** argv)
     // variables that handle the files
     SNDFILE* infile = NULL;
     SNDFILE* outfile = NULL;
+    MAPOUT* mapout = NULL;          // the output when it is rendered straight into a mapping
+    int mapped = 0;                 // flag to write the output through a memory mapping
+    int woven = 0;                  // flag to run the output through weave before writing it
+    CHAIN* chain = NULL;
     SF_INFO info;
     unsigned long filesize;
     double length_secs;
 
     // variables that handle the read/write buffers
-    float* inframe = NULL;
+    ARENA* arena = NULL;            // the buffers, layers and shards are all laid out in here
+    size_t insize;                  // bytes the input takes up
+    size_t footprint;               // bytes the whole arena takes up
+    void* inbase = NULL;            // the input buffer including its guard frames
+    SOURCE source = {0, NULL, NULL};
+    int compact = 0;                // flag to keep 16-bit input as 16-bit samples
     float* outframe = NULL;
     float curframe;
     int nframes = NFRAMES;
     long framesread = 0;
     long frameswrite = 0;
+    long written;                   // frames the last write took
     long totalsamples;
+    long outsize;
 
     // variable that handle the layers and shards
     int layers;
@@ -44,6 +58,9 @@ int main(int argc, char** argv)
     int zc_override = 0;            // flag to check for overriding the zero crossing check
     int near_zero_mode = 0;         // flag to change the zero crossing to a quietness detector
     double near_zero = 0.0;         // the value for what set the shards
+    int scanned = 0;                // flag set when the split points were found while loading
+    int onset_mode = 0;             // flag to split shards at onsets and energy valleys instead
+    double sensitivity = 0.5;       // how readily the onset detector fires (0.0 - 1.0)
     long* zero_crossings = NULL;    // array to hold the zero crossing locations
     long min = DEFAULTMIN;          // min and max of the shard size, should be user changable in time
     long max = DEFAULTMAX;
@@ -60,6 +77,48 @@ int main(int argc, char** argv)
     LAYER** curlayer = NULL;
     SHARD** curshard = NULL;
 
+    // variables that handle the random numbers
+    unsigned long seed = 0;         // seed every layer's random numbers come from
+    int seeded = 0;                 // flag set when the seed is given instead of taken from the clock
+    int reseeds = 0;                // layers given seeds of their own
+    int* reseed_layer = NULL;
+    unsigned long* reseed_value = NULL;
+    RNG* rngs = NULL;               // random number stream of each layer
+
+    // variables that handle the stem cache
+    char* cache_dir = NULL;         // directory each layer's stem is kept in
+    STEM_CACHE* stems = NULL;
+
+    // variables that handle stem outputs
+    int stemcount = 0;              // channels or files the layers are spread over (0 for one mix)
+    int stemfiles = 0;              // flag to write each stem to a file of its own
+    SNDFILE** stemout = NULL;       // the stem files
+    char* stempath = NULL;
+    float* stemframe = NULL;        // each stem's frames, one stem after another
+
+    // variables that handle the render plan
+    char* plan_out = NULL;          // file to save the render plan to
+    char* plan_in = NULL;           // file to render a saved plan from
+    int threads = 1;                // number of threads rendering the plan
+    int planned = 0;                // flag set when the render goes through a plan
+    RENDER_POOL* pool = NULL;       // threads rendering the plan, started once
+    PLAN* plan = NULL;
+
+    // variables that handle the playback rates
+    double pitch_spread = 0.0;      // how far (in semitones) each layer's pitch can stray
+    int outrate = 0;                // sample rate of the output
+    unsigned long* steps = NULL;    // playback step of each layer
+    float** sincs = NULL;           // interpolation table of each layer off the original rate
+    SF_INFO outinfo;
+
+    // variables that handle checkpoints
+    int checkpoint = -1;            // seconds between checkpoints (-1 for none)
+    int resume = 0;                 // flag to carry on from the last checkpoint
+    char* ckpt_path = NULL;         // checkpoint kept next to the output
+    char* ckpt_plan = NULL;         // the plan the checkpoint belongs to
+    CHECKPOINT ckpt;
+    time_t last_ckpt = 0;
+
     printf("SHATTER: shatters an audio file over a number of layers\n");
 
     // handle options
@@ -85,6 +144,15 @@ int main(int argc, char** argv)
                     return 1;
                 }
                 break;
+            case('a'):
+                onset_mode = 1;
+                if(argv[1][2] != '\0')
+                    sensitivity = atof(&(argv[1][2]));
+                if(sensitivity < 0.0 || sensitivity > 1.0){
+                    printf("Onset sensitivity must be between 0.0 and 1.0.\n");
+                    return 1;
+                }
+                break;
             case('b'):
                 bias = atof(&(argv[1][2]));
                 if(bias < 0.0 || bias > 1.0){
@@ -95,6 +163,107 @@ int main(int argc, char** argv)
             case('l'):
                 list_shards = 1;
                 break;
+            case('p'):
+                plan_out = &(argv[1][2]);
+                if(*plan_out == '\0'){
+                    printf("Missing file name for the render plan.\n");
+                    return 1;
+                }
+                break;
+            case('r'):
+                plan_in = &(argv[1][2]);
+                if(*plan_in == '\0'){
+                    printf("Missing file name for the render plan.\n");
+                    return 1;
+                }
+                break;
+            case('j'):
+                threads = atoi(&(argv[1][2]));
+                if(threads < 1){
+                    printf("Number of threads cannot be < 1.\n");
+                    return 1;
+                }
+                break;
+            case('i'):
+                compact = 1;
+                break;
+            case('d'):
+                mapped = 1;
+                break;
+            case('w'):
+                woven = 1;
+                break;
+            case('k'):
+                checkpoint = (argv[1][2] == '\0') ? CHECKPOINTSECS : atoi(&(argv[1][2]));
+                if(checkpoint < 0){
+                    printf("Checkpoint interval cannot be < 0 seconds.\n");
+                    return 1;
+                }
+                break;
+            case('u'):
+                resume = 1;
+                break;
+            case('h'):
+                arena_huge_pages(1);
+                break;
+            case('y'):
+            case('q'):
+                stemcount = atoi(&(argv[1][2]));
+                stemfiles = (argv[1][1] == 'q');
+                if(stemcount < 1){
+                    printf("Number of stems must be 1 or more.\n");
+                    return 1;
+                }
+                break;
+            case('c'):
+                cache_dir = &(argv[1][2]);
+                if(*cache_dir == '\0'){
+                    printf("Missing stem cache directory.\n");
+                    return 1;
+                }
+                break;
+            case('g'):
+                if(strchr(&(argv[1][2]),':')){
+                    // a seed for one layer only
+                    reseed_layer = (int*)realloc(reseed_layer,sizeof(int) * (reseeds + 1));
+                    reseed_value = (unsigned long*)realloc(reseed_value,sizeof(unsigned long) * (reseeds + 1));
+                    if(reseed_layer == NULL || reseed_value == NULL){
+                        printf("Error allocating memory for seeds.\n");
+                        return 1;
+                    }
+                    reseed_layer[reseeds] = atoi(&(argv[1][2]));
+                    reseed_value[reseeds] = strtoul(strchr(&(argv[1][2]),':') + 1,NULL,10);
+                    if(reseed_layer[reseeds] < 1){
+                        printf("Layers are numbered from 1.\n");
+                        return 1;
+                    }
+                    reseeds++;
+                } else {
+                    seed = strtoul(&(argv[1][2]),NULL,10);
+                    seeded = 1;
+                }
+                break;
+            case('v'):
+                pitch_spread = atof(&(argv[1][2]));
+                if(pitch_spread < 0.0 || pitch_spread > 24.0){
+                    printf("Pitch spread must be between 0 and 24 semitones.\n");
+                    return 1;
+                }
+                break;
+            case('o'):
+                outrate = atoi(&(argv[1][2]));
+                if(outrate < 1){
+                    printf("Output sample rate cannot be < 1.\n");
+                    return 1;
+                }
+                break;
+            case('f'):
+                nframes = atoi(&(argv[1][2]));
+                if(nframes < 1){
+                    printf("Block size cannot be < 1 frame.\n");
+                    return 1;
+                }
+                break;
             case('m'):
                 min_override = 1;
                 min = atoi(&(argv[1][2]));
@@ -139,6 +308,9 @@ int main(int argc, char** argv)
                 "\t\t\tcrossings, allowing them to split anywhere.\n"
                 "\t\t-n :\tChanges the zero crossing check to use an amplitude\n"
                 "\t\t\tthreshold for determining where shards split (ex. -n0.01)\n"
+                "\t\t-a :\tSplits shards at onsets and in the quiet between\n"
+                "\t\t\tthem, optionally setting how readily onsets are found\n"
+                "\t\t\t(0.0 < sensitivity < 1.0, default: 0.5) (ex. -a0.7)\n"
                 "\t\t-s :\tIgnore zero crossings (or threshold points) before\n"
                 "\t\t\tthis position (in seconds) (ex. -s2.3)\n"
                 "\t\t-e :\tIgnore zero crossings (or threshold points) after\n"
@@ -154,12 +326,45 @@ int main(int argc, char** argv)
                 "\t\t\t(default minimum: 62 ms) (ex. -m200)\n"
                 "\t\t-x :\tSets the maximum size of the shard(s) (in microseconds)\n"
                 "\t\t\t(default maximum is the length of the file) (ex. -x2000)\n"
+                "\t\t-p :\tSaves the render plan (every shard decision) to a\n"
+                "\t\t\tfile and renders from it (ex. -pshards.plan)\n"
+                "\t\t-r :\tRenders a saved plan instead of collecting new shards.\n"
+                "\t\t\tLength and layers are taken from the plan (ex. -rshards.plan)\n"
+                "\t\t-j :\tNumber of threads rendering the plan, each taking\n"
+                "\t\t\ta separate stretch of time (default: 1) (ex. -j4)\n"
+                "\t\t-f :\tSize of the read/write blocks in frames\n"
+                "\t\t\t(default: 1024) (ex. -f4096)\n"
+                "\t\t-i :\tKeeps a 16-bit input in memory as 16-bit samples,\n"
+                "\t\t\thalving the memory it takes up\n"
+                "\t\t-d :\tRenders straight into a memory-mapped output file\n"
+                "\t\t\t(16-bit or float WAV/raw only)\n"
+                "\t\t-w :\tRuns the output through weave (default patch) on\n"
+                "\t\t\tits own thread before writing it\n"
+                "\t\t-k :\tSaves a checkpoint next to the output this often\n"
+                "\t\t\t(in seconds) (default: 60) (ex. -k300)\n"
+                "\t\t-u :\tResumes an interrupted render from its last\n"
+                "\t\t\tcheckpoint (use the same options as before)\n"
+                "\t\t-g :\tSeeds the random numbers (default: the clock),\n"
+                "\t\t\tor reseeds one layer only (ex. -g1234 or -g3:99)\n"
+                "\t\t-c :\tKeeps each layer's stem in a cache directory, and\n"
+                "\t\t\tonly renders the layers that changed (ex. -cstems)\n"
+                "\t\t-y :\tSpreads the layers over this many channels of the\n"
+                "\t\t\toutput, neighbouring layers sharing one (ex. -y4)\n"
+                "\t\t-q :\tWrites the layers to this many separate files in\n"
+                "\t\t\tthe same way (out_1.wav, out_2.wav...) (ex. -q4)\n"
+                "\t\t-h :\tBacks the input and output buffers with huge\n"
+                "\t\t\tpages where the system has them\n"
+                "\t\t-v :\tGives each layer a random pitch (and speed) up to\n"
+                "\t\t\tthis many semitones from the original (ex. -v3.5)\n"
+                "\t\t-o :\tSample rate of the output, converted while rendering\n"
+                "\t\t\t(default is the rate of the input) (ex. -o48000)\n"
                 );
         return 1;
     }
 
-    // seed the randomness
-    srand(time(NULL));
+    // seed the randomness (each layer gets a stream of its own from this)
+    if(!seeded)
+        seed = time(NULL);
 
     /******* handle the arguments *******/
 
@@ -187,10 +392,138 @@ int main(int argc, char** argv)
         error++;
         goto exit;
     }
+    if(compact && (info.format & SF_FORMAT_SUBMASK) != SF_FORMAT_PCM_16){
+        printf("Only 16-bit PCM input can be kept as 16-bit samples.\n");
+        error++;
+        goto exit;
+    }
+    if(info.frames >= (1L << (63 - RATE_BITS))){
+        printf("Input is too long to play at fractional rates.\n");
+        error++;
+        goto exit;
+    }
+
+    if(checkpoint >= 0 || resume){
+        if(woven){
+            printf("Checkpoints can't be taken while chaining into weave.\n");
+            error++;
+            goto exit;
+        }
+        ckpt_path = (char*)malloc(strlen(argv[ARG_OUTFILE]) + 6);
+        ckpt_plan = (char*)malloc(strlen(argv[ARG_OUTFILE]) + 6);
+        if(ckpt_path == NULL || ckpt_plan == NULL){
+            printf("Error allocating memory for checkpoints.\n");
+            error++;
+            goto exit;
+        }
+        sprintf(ckpt_path,"%s.ckpt",argv[ARG_OUTFILE]);
+        sprintf(ckpt_plan,"%s.plan",argv[ARG_OUTFILE]);
+    }
+    if(resume){
+        // the checkpoint's plan is rendered from where the checkpoint left off
+        if(checkpoint_load(&ckpt,ckpt_path)){
+            printf("Error reading checkpoint %s\n",ckpt_path);
+            error++;
+            goto exit;
+        }
+        if(checkpoint < 0)
+            checkpoint = CHECKPOINTSECS;
+        plan_in = ckpt_plan;
+    }
+    if(plan_in){
+        // a saved plan already holds every shard decision, so there is nothing to scan
+        plan = plan_load(plan_in);
+        if(plan == NULL){
+            printf("Error reading render plan %s\n",plan_in);
+            error++;
+            goto exit;
+        }
+        if((sf_count_t)plan->size != info.frames || plan->srate != info.samplerate){
+            printf("Render plan %s was not made from %s\n",plan_in,argv[ARG_INFILE]);
+            error++;
+            goto exit;
+        }
+        layers = plan->layers;
+        outrate = plan->outrate;
+        printf("Loaded render plan from %s\n",plan_in);
+    }
+    if(resume && (ckpt.totalframes != plan->totalframes || ckpt.size != plan->size || ckpt.srate != plan->srate
+                  || ckpt.outrate != plan->outrate || ckpt.layers != plan->layers)){
+        printf("Checkpoint %s does not belong to render plan %s\n",ckpt_path,ckpt_plan);
+        error++;
+        goto exit;
+    }
+    if(stemcount){
+        if(woven || mapped || cache_dir || checkpoint >= 0 || resume){
+            printf("Stems can't be written with -w, -d, -c, -k or -u.\n");
+            error++;
+            goto exit;
+        }
+        if(stemcount > layers){
+            printf("Can't spread %d layer(s) over %d stems.\n",layers,stemcount);
+            error++;
+            goto exit;
+        }
+    }
+    if(outrate == 0)
+        outrate = info.samplerate;
+
+    rngs = (RNG*)malloc(sizeof(RNG) * layers);
+    if(rngs == NULL){
+        printf("Error allocating memory for layers.\n");
+        error++;
+        goto exit;
+    }
+    for(int i = 0; i < layers; i++)
+        rngs[i] = layer_seed(seed,i);
+    for(int i = 0; i < reseeds; i++){
+        if(reseed_layer[i] > layers){
+            printf("There is no layer %d to reseed.\n",reseed_layer[i]);
+            error++;
+            goto exit;
+        }
+        rngs[reseed_layer[i] - 1] = layer_seed(reseed_value[i],reseed_layer[i] - 1);
+    }
+    if(plan == NULL)
+        printf("Seed: %lu\n",seed);
+
+    // work out the playback rate of each layer, the output rate conversion included
+    steps = (unsigned long*)malloc(sizeof(unsigned long) * layers);
+    if(steps == NULL){
+        printf("Error allocating memory for layers.\n");
+        error++;
+        goto exit;
+    }
+    for(int i = 0; i < layers; i++){
+        if(plan){
+            steps[i] = plan->layer[i].step;
+        } else {
+            double semitones = 0.0;
+            if(pitch_spread > 0.0)
+                semitones = pitch_spread * ((2.0 * rng_next(&rngs[i]) / (double)RAND_MAX) - 1.0);
+            steps[i] = llround(RATE_ONE * pow(2.0,semitones / 12.0) * info.samplerate / outrate);
+            if(steps[i] == 0) steps[i] = 1;
+            if(steps[i] > STEP_MAX){
+                printf("The output sample rate is too low for this source.\n");
+                error++;
+                goto exit;
+            }
+        }
+    }
+    sincs = new_sincs(steps,layers);
+    if(sincs == NULL){
+        printf("Error allocating memory for interpolation.\n");
+        error++;
+        goto exit;
+    }
+    if(plan){
+        for(int i = 0; i < layers; i++)
+            plan->layer[i].sinc = sincs[i];
+    }
 
     /**** necessary calculations ****/
     end_lim = filesize = info.frames;               // get number of samples in input file
-    totalsamples = length_secs * info.samplerate;   // calculate size of output file
+    totalsamples = length_secs * outrate;           // calculate size of output file
     if(min_override){                               // calculate min and max of shard size
         min = ((double)min * 0.001) * info.samplerate;
     } else {
@@ -215,124 +548,430 @@ int main(int argc, char** argv)
         goto exit;
     }
 
-    // allocate memory for the I/O buffers
-    inframe = (float*)malloc(sizeof(float) * filesize);
-    if(inframe == NULL){
+    // lay out everything the render needs in one arena up front: the input, the output
+    // blocks and, when rendering shard by shard, the layers and shards
+    planned = plan || plan_out || threads > 1 || mapped || checkpoint >= 0 || cache_dir || stemcount;
+    outsize = planned ? (long)nframes * PLANBLOCKS * threads : nframes;
+    insize = (filesize + 1 + SINC_TAPS) * (compact ? sizeof(short) : sizeof(float));
+    footprint = arena_round(insize) + arena_round(sizeof(float) * outsize * info.channels * (stemcount ? stemcount : 1))
+                + arena_round(sizeof(float) * outsize * stemcount);
+    if(!planned){
+        footprint += arena_round(sizeof(LAYER*) * layers) + arena_round(sizeof(SHARD*) * layers)
+                     + layers * (arena_round(sizeof(LAYER)) + arena_round(sizeof(SHARD)));
+    }
+    if(planned && threads > 1)
+        footprint += render_pool_footprint(threads);
+    arena = new_arena(footprint);
+
+    // the input has silent guard frames around it
+    // (shards can end on the last frame, and interpolation reaches either side)
+    inbase = arena_alloc(arena,insize);
+    if(inbase == NULL){
         printf("Error allocating memory for input.\n");
         error++;
         goto exit;
     }
+    source.size = filesize;
+    if(compact)
+        source.pcm = (short*)inbase + SINC_TAPS / 2;
+    else
+        source.frames = (float*)inbase + SINC_TAPS / 2;
 
-    // fill the input buffer (find zero crossings later in this loop, maybe?)
-    printf("Copying file to input... ");
-    for(long i = 0; i < filesize; i++){
-        framesread = sf_read_float(infile,&curframe,1);
-        if(framesread != 1){
-            printf("Error reading audio frame from input.\n");
+    if(threads > 1 && info.seekable){
+        // decode separate ranges of the input at once, scanning each as it comes in
+        int scan = SCAN_NONE;
+        if(plan == NULL && !zc_override && !onset_mode)
+            scan = near_zero_mode ? SCAN_NEAR_ZERO : SCAN_ZERO;
+        printf("Copying file to input on %d threads... ",threads);
+        zc_count = load_source(argv[ARG_INFILE],&source,threads,scan,near_zero,
+                               near_zero_mode ? start_lim : 0,end_lim,&zero_crossings);
+        if(zc_count < 0){
+            printf("\nError reading audio frames from input.\n");
             error++;
             goto exit;
         }
-        inframe[i] = curframe;
-        printf("\rCopying file to input... %.0f%% done.",((double)i / (double)filesize) * 100.0);
-    }
-    printf("\rCopying file to input... 100%% done.\n");
-
-    // find zero crossings and build zero crossings array
-    /*  I could probably do this at the same time as I copy the audio file into the
-        buffer, but I was having problems with the zero_crossings array. So, I'm
-        keeping it compartmentalizing it all for now */
-    if(zc_override){
-        for(long i = start_lim; i < end_lim; i++){
-            /* there's obviously a much more memory efficent way to 
-               do this, but I'm implementing this so far to check the sound.
-               Post-listen: after a few tests the end result doesn't really
-               sound much different if at all. So, I expect for this to be
-               used rarely. Might come back to it. */
-            zero_crossings = (long*)realloc(zero_crossings,sizeof(long) * ++zc_count);
-            zero_crossings[zc_count-1] = i;
-        }
-    } else if (near_zero_mode){
-        printf("Scanning for near zero points... ");
-        for(long i = start_lim; i < end_lim; i++){
-            double current_value = fabs(inframe[i]);
-            if(current_value <= near_zero){
-                zero_crossings = (long*)realloc(zero_crossings,sizeof(long) * (++zc_count + 1)); // with guard point
-                zero_crossings[zc_count-1] = i;
+        scanned = (scan != SCAN_NONE);
+        printf("done.\n");
+    } else {
+        // fill the input buffer (find zero crossings later in this loop, maybe?)
+        printf("Copying file to input... ");
+        for(long i = 0; i < (long)filesize; i++){
+            if(compact){
+                short cursample;
+                framesread = sf_read_short(infile,&cursample,1);
+                source.pcm[i] = cursample;
+            } else {
+                framesread = sf_read_float(infile,&curframe,1);
+                source.frames[i] = curframe;
             }
-            printf("\rScanning for near zero points... %ld found.",zc_count);
+            if(framesread != 1){
+                printf("Error reading audio frame from input.\n");
+                error++;
+                goto exit;
+            }
+            printf("\rCopying file to input... %.0f%% done.",((double)i / (double)filesize) * 100.0);
         }
-        printf("\rScanning for near zero points... %ld found.\n",zc_count);
-    } else {
-        printf("Scanning for zero crossings... ");
-        for(long i = 0; i < end_lim; i++){
-            if(inframe[i] == 0.0){
-                zero_crossings = (long*)realloc(zero_crossings,sizeof(long) * (++zc_count + 1)); // with guard point
+        printf("\rCopying file to input... 100%% done.\n");
+    }
+
+    if(plan == NULL){
+        // find zero crossings and build zero crossings array
+        /*  I could probably do this at the same time as I copy the audio file into the
+            buffer, but I was having problems with the zero_crossings array. So, I'm
+            keeping it compartmentalizing it all for now */
+        if(zc_override){
+            for(long i = start_lim; i < end_lim; i++){
+                /* there's obviously a much more memory efficent way to 
+                   do this, but I'm implementing this so far to check the sound.
+                   Post-listen: after a few tests the end result doesn't really
+                   sound much different if at all. So, I expect for this to be
+                   used rarely. Might come back to it. */
+                zero_crossings = (long*)realloc(zero_crossings,sizeof(long) * ++zc_count);
                 zero_crossings[zc_count-1] = i;
             }
-            printf("\rScanning for zero crossings... %ld found.",zc_count);
+        } else if (onset_mode){
+            printf("Scanning for onsets... ");
+            zc_count = find_onsets(&source,start_lim,(end_lim < (long)filesize) ? end_lim : (long)filesize,
+                                   sensitivity,&zero_crossings);
+            if(zc_count < 2){
+                printf("\n%s\n",(zc_count < 0) ? "Error allocating memory for onsets."
+                                              : "Too few onsets found, try a higher sensitivity.");
+                error++;
+                goto exit;
+            }
+            printf("%ld found.\n",zc_count);
+        } else if (scanned){
+            printf("%ld %s found while copying.\n",zc_count,near_zero_mode ? "near zero points" : "zero crossings");
+        } else if (near_zero_mode){
+            printf("Scanning for near zero points... ");
+            for(long i = start_lim; i < end_lim; i++){
+                double current_value = fabs(source_read(&source,i));
+                if(current_value <= near_zero){
+                    zero_crossings = (long*)realloc(zero_crossings,sizeof(long) * (++zc_count + 1)); // with guard point
+                    zero_crossings[zc_count-1] = i;
+                }
+                printf("\rScanning for near zero points... %ld found.",zc_count);
+            }
+            printf("\rScanning for near zero points... %ld found.\n",zc_count);
+        } else {
+            printf("Scanning for zero crossings... ");
+            for(long i = 0; i < end_lim; i++){
+                if(source_read(&source,i) == 0.0){
+                    zero_crossings = (long*)realloc(zero_crossings,sizeof(long) * (++zc_count + 1)); // with guard point
+                    zero_crossings[zc_count-1] = i;
+                }
+                printf("\rScanning for zero crossings... %ld found.",zc_count);
+            }
+            printf("\rScanning for zero crossings... %ld found.\n",zc_count);
         }
-        printf("\rScanning for zero crossings... %ld found.\n",zc_count);
-    }
-    if(end_lim != filesize){
-        zero_crossings[zc_count] = zero_crossings[zc_count-1]; // just make sure it's a zc
-    } else
-        zero_crossings[zc_count] = end_lim; // make last value the end of file
+        if(end_lim != (long)filesize){
+            zero_crossings[zc_count] = zero_crossings[zc_count-1]; // just make sure it's a zc
+        } else
+            zero_crossings[zc_count] = end_lim; // make last value the end of file
     
 
-    printf("Shattering input... ");
-    // build the layers
-    curlayer = (LAYER**)malloc(sizeof(LAYER*) * layers);
-    for(int i = 0; i < layers; i++){
-        curlayer[i] = (LAYER*)malloc(sizeof(LAYER));
-        layer_init(curlayer[i],layers,filesize);
-        if(curlayer[i] == NULL){
-            printf("Error creating audio layer.\n");
+        if(!shard_possible(zero_crossings,zc_count,min,max)){
+            printf("No split points are between the minimum and maximum shard size apart.\n");
             error++;
             goto exit;
         }
-    }
-    if(list_shards) printf("Collecting first shards...\n");
 
-    // build and prepare the shards
-    curshard = (SHARD**)malloc(sizeof(SHARD*) * layers);
-    for(int i = 0; i < layers; i++){
-        curshard[i] = (SHARD*)malloc(sizeof(SHARD));
-        new_shard(curshard[i],zero_crossings,zc_count,min,max);
-        if(list_shards){
-            observe_shard(i,curshard[i],info.samplerate);
+        printf("Shattering input... ");
+        if(planned){
+            // collect every shard up front so the render can be split over time
+            if(list_shards) printf("Collecting shards...\n");
+            plan = plan_shatter(zero_crossings,zc_count,min,max,bias,layers,rngs,steps,filesize,
+                                info.samplerate,outrate,totalsamples,tail,nframes,list_shards);
+            if(plan == NULL){
+                printf("Error creating render plan.\n");
+                error++;
+                goto exit;
+            }
+            for(int i = 0; i < layers; i++)
+                plan->layer[i].sinc = sincs[i];
+            printf("Done.\n");
+        } else {
+            // build the layers (each layer and shard on cache lines of its own)
+            curlayer = (LAYER**)arena_alloc(arena,sizeof(LAYER*) * layers);
+            curshard = (SHARD**)arena_alloc(arena,sizeof(SHARD*) * layers);
+            for(int i = 0; i < layers; i++){
+                curlayer[i] = (LAYER*)arena_alloc(arena,sizeof(LAYER));
+                curshard[i] = (SHARD*)arena_alloc(arena,sizeof(SHARD));
+                if(curlayer[i] == NULL || curshard[i] == NULL){
+                    printf("Error creating audio layer.\n");
+                    error++;
+                    goto exit;
+                }
+                layer_init(curlayer[i],layers,filesize,steps[i],sincs[i]);
+            }
+            if(list_shards) printf("Collecting first shards...\n");
+
+            // prepare the shards
+            for(int i = 0; i < layers; i++){
+                curshard[i]->rng = rngs[i];
+                new_shard(curshard[i],zero_crossings,zc_count,min,max);
+                if(list_shards){
+                    observe_shard(i,curshard[i],info.samplerate);
+                }
+                activate_shard(curshard[i]);
+            }
+            printf("Done.\n");
         }
-        activate_shard(curshard[i]);
-    }
-    printf("Done.\n");
 
-    // this way of tracking the number of possible shards could be used 
-    // as a better method for creating shards... will give it thought
-    for(int i = 0; i < zc_count; i++){
-        long base = zero_crossings[i];
-        int j = 1;
-        while((zero_crossings[i + j] - zero_crossings[i]) < min && (i + j) < zc_count)
-            j++;
-        for(;(i + j) < zc_count; j++){
-            if((zero_crossings[i + j] - zero_crossings[i]) > max) break;
-            possible_shards++;
+        // this way of tracking the number of possible shards could be used 
+        // as a better method for creating shards... will give it thought
+        for(int i = 0; i < zc_count; i++){
+            long base = zero_crossings[i];
+            int j = 1;
+            while((zero_crossings[i + j] - zero_crossings[i]) < min && (i + j) < zc_count)
+                j++;
+            for(;(i + j) < zc_count; j++){
+                if((zero_crossings[i + j] - zero_crossings[i]) > max) break;
+                possible_shards++;
+            }
         }
-    }
 
-    printf("Shattered into %d possible shard(s)...\n",possible_shards);
+        printf("Shattered into %d possible shard(s)...\n",possible_shards);
+    }
+    if(plan_out){
+        if(plan_save(plan,plan_out)){
+            printf("Error saving render plan to %s\n",plan_out);
+            error++;
+            goto exit;
+        }
+        printf("Render plan saved to %s\n",plan_out);
+    }
+    if(checkpoint >= 0 && !resume){
+        if(plan_save(plan,ckpt_plan)){
+            printf("Error saving render plan to %s\n",ckpt_plan);
+            error++;
+            goto exit;
+        }
+    }
 
     /**** get the output ready ****/
-    outframe = (float*)malloc(sizeof(float) * nframes * info.channels);
-    if(outframe == NULL){
-        printf("Error allocating memory for output.\n");
+    outinfo = info;
+    outinfo.samplerate = outrate;
+    if(stemcount && !stemfiles)
+        outinfo.channels = stemcount;       // one channel for each stem
+    if(resume && (ckpt.mapped != mapped || ckpt.format != outinfo.format)){
+        // frames have to go on where the last run put them, in the same layout
+        printf("Checkpoint %s was taken of a different kind of output (resume with the same options)\n",ckpt_path);
         error++;
         goto exit;
     }
+    if(mapped){
+        // the plan knows exactly how long the output will be
+        if(resume)
+            mapout = map_reopen(argv[ARG_OUTFILE],&outinfo,plan->totalframes,ckpt.frames);
+        else
+            mapout = map_output(argv[ARG_OUTFILE],&outinfo,plan->totalframes);
+        if(resume && (mapout == NULL || ckpt.offset != (long)mapout->header)){
+            // map_reopen turns away a file whose header isn't laid out the way it writes them
+            printf("Error reopening %s where its checkpoint left off\n",argv[ARG_OUTFILE]);
+            error++;
+            goto exit;
+        }
+        if(mapout == NULL){
+            printf("Error mapping output file: %s\n"
+                   "(only 16-bit or float WAV/raw files can be mapped)\n",argv[ARG_OUTFILE]);
+            error++;
+            goto exit;
+        }
+    }
+    if(mapout == NULL || mapout->pcm || woven){
+        outframe = (float*)arena_alloc(arena,sizeof(float) * outsize * outinfo.channels);
+        if(outframe == NULL){
+            printf("Error allocating memory for output.\n");
+            error++;
+            goto exit;
+        }
+    }
+    if(stemcount){
+        stemframe = (float*)arena_alloc(arena,sizeof(float) * outsize * stemcount);
+        if(stemframe == NULL){
+            printf("Error allocating memory for output.\n");
+            error++;
+            goto exit;
+        }
+    }
+    if(planned && threads > 1){
+        pool = new_render_pool(arena,threads);
+        if(pool == NULL){
+            printf("Error starting render threads.\n");
+            error++;
+            goto exit;
+        }
+    }
     // if that's all okay, create the output file
-    outfile = sf_open(argv[ARG_OUTFILE],SFM_WRITE,&info);
-    if(outfile == NULL){
-        printf("Error creating file: %s\n",argv[ARG_OUTFILE]);
-        error++;
-        goto exit;
+    if(mapout == NULL && resume){
+        // the output has to hold at least what the checkpoint says was written
+        SF_INFO kept = {0};
+        int formats = SF_FORMAT_TYPEMASK | SF_FORMAT_SUBMASK;
+        outfile = sf_open(argv[ARG_OUTFILE],SFM_RDWR,&kept);
+        if(outfile == NULL || (kept.format & formats) != (ckpt.format & formats) || kept.samplerate != outrate
+           || kept.channels != info.channels || kept.frames < ckpt.frames
+           || sf_seek(outfile,ckpt.frames,SEEK_SET) != ckpt.frames){
+            printf("Error reopening %s where its checkpoint left off\n",argv[ARG_OUTFILE]);
+            error++;
+            goto exit;
+        }
+    } else if(stemfiles){
+        // each stem goes into a file of its own, named after the output
+        char* dot = strrchr(argv[ARG_OUTFILE],'.');
+        char* slash = strrchr(argv[ARG_OUTFILE],'/');
+        int base = (dot && (slash == NULL || dot > slash)) ? (int)(dot - argv[ARG_OUTFILE]) : (int)strlen(argv[ARG_OUTFILE]);
+
+        stemout = (SNDFILE**)calloc(stemcount,sizeof(SNDFILE*));
+        stempath = (char*)malloc(strlen(argv[ARG_OUTFILE]) + 16);
+        if(stemout == NULL || stempath == NULL){
+            printf("Error allocating memory for output.\n");
+            error++;
+            goto exit;
+        }
+        for(int k = 0; k < stemcount; k++){
+            sprintf(stempath,"%.*s_%d%s",base,argv[ARG_OUTFILE],k + 1,argv[ARG_OUTFILE] + base);
+            stemout[k] = sf_open(stempath,SFM_WRITE,&outinfo);
+            if(stemout[k] == NULL){
+                printf("Error creating file: %s\n",stempath);
+                error++;
+                goto exit;
+            }
+        }
+    } else if(mapout == NULL){
+        outfile = sf_open(argv[ARG_OUTFILE],SFM_WRITE,&outinfo);
+        if(outfile == NULL){
+            printf("Error creating file: %s\n",argv[ARG_OUTFILE]);
+            error++;
+            goto exit;
+        }
+    }
+    if(checkpoint >= 0){
+        if(resume){
+            frameswrite = ckpt.frames;
+            printf("Resuming from %.2f seconds...\n",(double)frameswrite / outrate);
+        } else {
+            ckpt.frames = 0;
+            ckpt.totalframes = plan->totalframes;
+            ckpt.size = plan->size;
+            ckpt.srate = plan->srate;
+            ckpt.outrate = plan->outrate;
+            ckpt.layers = plan->layers;
+            ckpt.format = outinfo.format;
+            ckpt.mapped = (mapout != NULL);
+            ckpt.offset = mapout ? (long)mapout->header : 0;
+            if(checkpoint_save(&ckpt,ckpt_path)){
+                printf("Error saving checkpoint %s\n",ckpt_path);
+                error++;
+                goto exit;
+            }
+        }
+        last_ckpt = time(NULL);
+    }
+    if(cache_dir){
+        stems = open_stems(plan,source_hash(&source),cache_dir,outsize);
+        if(stems == NULL){
+            printf("Error opening stem cache %s\n",cache_dir);
+            error++;
+            goto exit;
+        }
+        printf("%d of %d layer(s) found in the stem cache.\n",stems->cached,plan->layers);
+    }
+    if(woven){
+        chain = new_chain(outrate,nframes,outfile,mapout);
+        if(chain == NULL){
+            printf("Error starting weave.\n");
+            error++;
+            goto exit;
+        }
+    }
+    if(plan){
+        /**** render the plan a stretch of time at a time, each thread taking part of it ****/
+        while(frameswrite < plan->totalframes){
+            long count = plan->totalframes - frameswrite;
+            if(count > outsize) count = outsize;
+            // float outputs are rendered in place in the mapping, everything else into outframe
+            float* dest = (mapout && !chain) ? map_frames(mapout,frameswrite) : NULL;
+            if(dest == NULL)
+                dest = outframe;
+            if(stemcount){
+                plan_render_parallel(pool,plan,&source,stemframe,frameswrite,count,stemcount);
+            } else if(stems){
+                if(stem_render(stems,pool,plan,&source,dest,frameswrite,count)){
+                    printf("\nError reading or writing stems in %s\n",cache_dir);
+                    error++;
+                    goto exit;
+                }
+            } else {
+                plan_render_parallel(pool,plan,&source,dest,frameswrite,count,1);
+            }
+            if(stemcount){
+                // the stems go out one to a file, or interleaved as the channels of one
+                int stemswritten = 0;
+                if(stemfiles){
+                    for(int k = 0; k < stemcount; k++){
+                        if(sf_write_float(stemout[k],stemframe + k * count,count) == count)
+                            stemswritten++;
+                    }
+                } else {
+                    for(long i = 0; i < count; i++){
+                        for(int k = 0; k < stemcount; k++){
+                            outframe[i * stemcount + k] = stemframe[k * count + i];
+                        }
+                    }
+                    if(sf_writef_float(outfile,outframe,count) == count)
+                        stemswritten = stemcount;
+                }
+                if(stemswritten != stemcount){
+                    printf("\nError writing to outfile\n");
+                    error++;
+                    goto exit;
+                }
+            } else if(chain){
+                if(chain_write(chain,outframe,count) != count){
+                    printf("\nError writing to outfile\n");
+                    error++;
+                    goto exit;
+                }
+            } else if(mapout){
+                // 16-bit outputs are converted into the mapping, floats are already in it
+                if(map_write(mapout,dest,frameswrite,count) != count){
+                    printf("\nError writing to outfile\n");
+                    error++;
+                    goto exit;
+                }
+            } else {
+                for(long i = 0; i < count; i += nframes){
+                    long n = (count - i < nframes) ? count - i : nframes;
+                    if(sf_write_float(outfile,outframe + i,n) != n){
+                        printf("\nError writing to outfile\n");
+                        error++;
+                        goto exit;
+                    }
+                }
+            }
+            frameswrite += count;
+            printf("\rWriting output... %.0f%% done.",((double)frameswrite / (double)plan->totalframes) * 100.0);
+            if(checkpoint >= 0 && time(NULL) - last_ckpt >= checkpoint && frameswrite < plan->totalframes){
+                // everything up to here has to be on disk before the checkpoint says so
+                int synced = 0;
+                if(mapout){
+                    synced = map_sync(mapout,frameswrite);
+                } else {
+                    sf_command(outfile,SFC_UPDATE_HEADER_NOW,NULL,0);
+                    sf_write_sync(outfile);
+                }
+                ckpt.frames = frameswrite;
+                if(synced || checkpoint_save(&ckpt,ckpt_path)){
+                    printf("\nError saving checkpoint %s\n",ckpt_path);
+                    error++;
+                    goto exit;
+                }
+                last_ckpt = time(NULL);
+            }
+        }
+        printf("\n");
+        goto done;
     }
     if(list_shards)
         printf("Writing output...\n");
@@ -342,7 +981,7 @@ int main(int argc, char** argv)
             float curframe = 0.0;
             for(int j = 0; j < layers; j++){
                 change_check = 0;
-                curframe += shard_tick(curlayer[j],curshard[j],inframe,&change_check,bias);
+                curframe += shard_tick(curlayer[j],curshard[j],&source,&change_check,bias);
                 if(change_check == 1){
                     new_shard(curshard[j],zero_crossings,zc_count,min,max);
                     if(list_shards) observe_shard(j,curshard[j],info.samplerate);
@@ -353,7 +992,13 @@ int main(int argc, char** argv)
         }
         if(!list_shards)
             printf("\rWriting output... %.0f%% done.",((double)frameswrite / (double)totalsamples) * 100.0);
-        frameswrite += sf_write_float(outfile,outframe,nframes);
+        written = chain ? chain_write(chain,outframe,nframes) : sf_write_float(outfile,outframe,nframes);
+        frameswrite += written;
+        if(written != nframes){
+            printf("\nError writing to outfile\n");
+            error++;
+            goto exit;
+        }
     }
     printf("\nCleaning shards... ");
     if(tail){
@@ -363,41 +1008,80 @@ int main(int argc, char** argv)
                 float curframe = 0.0;
                 stopped_layers = 0;
                 for(int j = 0; j < layers; j++){
-                    curframe += shard_tick(curlayer[j],curshard[j],inframe,0,1);
+                    curframe += shard_tick(curlayer[j],curshard[j],&source,0,1);
                     if(curlayer[j]->play == 0) stopped_layers++;
                 }
                 outframe[i] = curframe;
             }
-            frameswrite += sf_write_float(outfile,outframe,nframes);
+            written = chain ? chain_write(chain,outframe,nframes) : sf_write_float(outfile,outframe,nframes);
+            frameswrite += written;
+            if(written != nframes){
+                printf("\nError writing to outfile\n");
+                error++;
+                goto exit;
+            }
         }
     }
 
 
+done:
+    if(chain && finish_chain(chain)){
+        printf("Error writing to outfile\n");
+        error++;
+        goto exit;
+    }
     printf("Done.\nOutput saved to %s\n",argv[ARG_OUTFILE]);
 
 exit:
     if(error){
         printf("%d error(s)\n",error);
     }
+    destroy_chain(chain);       // the weave thread writes to the output, so it stops first
     if(outfile){
         if(sf_close(outfile)){
             printf("Error closing output file.\n");
         }
     }
+    if(stemout){
+        for(int k = 0; k < stemcount; k++){
+            if(stemout[k] && sf_close(stemout[k])){
+                printf("Error closing stem %d\n",k + 1);
+            }
+        }
+        free(stemout);
+    }
+    if(mapout){
+        if(unmap_output(mapout,frameswrite)){
+            printf("Error closing output file.\n");
+        }
+    }
     if(infile){
         if(sf_close(infile)){
             printf("Error closing %s\n",argv[ARG_INFILE]);
         }
     }
-    if(inframe)  free(inframe);
-    if(outframe) free(outframe);
-    if(curlayer){
-        destroy_layers(curlayer,layers);
+    if(stems){
+        if(close_stems(stems,!error && frameswrite == plan->totalframes)){
+            printf("Error saving stems to %s\n",cache_dir);
+        }
     }
-    if(curshard){
-        destroy_shards(curshard,layers);
+    if(ckpt_path && !error){
+        // the render finished, so there is nothing left to resume
+        checkpoint_remove(ckpt_path);
+        remove(ckpt_plan);
     }
+    if(ckpt_path) free(ckpt_path);
+    if(ckpt_plan) free(ckpt_plan);
+    destroy_render_pool(pool);
+    destroy_arena(arena);
+    if(stempath) free(stempath);
     if(zero_crossings) free(zero_crossings);
+    if(plan) destroy_plan(plan);
+    if(steps) free(steps);
+    if(rngs) free(rngs);
+    if(reseed_layer) free(reseed_layer);
+    if(reseed_value) free(reseed_value);
+    destroy_sincs(sincs,layers);
 
     return 0;
 }
\ No newline at end of file
@@ -3,15 +3,146 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+// the random number stream a layer starts from for a given seed
+/*  The seed and the layer number are mixed together so that neighbouring
+    seeds and layers still start far apart in the sequence. */
+RNG layer_seed(unsigned long seed, int layer)
+{
+    RNG rng = (RNG)seed ^ ((RNG)(layer + 1) * 0xD1B54A32D192ED03ULL);
+    rng_next(&rng);
+    return rng;
+}
 
 // initialize audio layer
-void layer_init(LAYER* curlayer, int layers, unsigned long filesize)
+void layer_init(LAYER* curlayer, int layers, unsigned long filesize, unsigned long step, float* sinc)
 {
     curlayer->play = 1;
     curlayer->ampfac = (1.0 / (double)layers);
     curlayer->sqrfac = (1.0 / sqrt((double)layers));
     curlayer->size = filesize;
     curlayer->index = 0;
+    curlayer->frac = 0;
+    curlayer->step = step;
+    curlayer->sinc = sinc;
+}
+
+// build the polyphase windowed-sinc table (cutoff as a fraction of the source's nyquist)
+/*  One row of SINC_TAPS coefficients for every fraction of a frame, plus
+    one extra so sinc_read can always blend a row with the next. The taps
+    cover the frames from index - (SINC_TAPS/2 - 1) to index + SINC_TAPS/2,
+    so the source needs that many silent guard frames on either side. */
+float* new_sinc(double cutoff)
+{
+    float* sinc = (float*)malloc(sizeof(float) * (SINC_PHASES + 1) * SINC_TAPS);
+    double half = SINC_TAPS / 2;
+
+    if(sinc == NULL)
+        return NULL;
+    for(int p = 0; p <= SINC_PHASES; p++){
+        float* row = sinc + p * SINC_TAPS;
+        double sum = 0.0;
+        for(int k = 0; k < SINC_TAPS; k++){
+            double x = (k - (half - 1)) - (double)p / SINC_PHASES;
+            double arg = M_PI * cutoff * x;
+            double h = (x == 0.0) ? cutoff : cutoff * sin(arg) / arg;
+            double w = 0.42 + 0.5 * cos(M_PI * x / half) + 0.08 * cos(2.0 * M_PI * x / half);
+            row[k] = h * w;
+            sum += row[k];
+        }
+        // keep the gain at 0 Hz at exactly one
+        for(int k = 0; k < SINC_TAPS; k++)
+            row[k] /= sum;
+    }
+    return sinc;
+}
+
+// the cutoff a layer playing at step needs so it doesn't alias
+static double sinc_cutoff(unsigned long step)
+{
+    return 0.92 * (step > RATE_ONE ? (double)RATE_ONE / step : 1.0);
+}
+
+// build the interpolation table of each layer
+/*  Only layers playing faster than the original rate need their cutoff
+    lowered, each by its own step, so a slow layer keeps the whole band.
+    Layers with the same cutoff share one table, and layers at RATE_ONE are
+    left without one as they never interpolate. */
+float** new_sincs(unsigned long* steps, int layers)
+{
+    float** sincs = (float**)calloc(layers, sizeof(float*));
+
+    if(sincs == NULL)
+        return NULL;
+    for(int i = 0; i < layers; i++){
+        if(steps[i] == RATE_ONE)
+            continue;
+        for(int j = 0; j < i && sincs[i] == NULL; j++){
+            if(sincs[j] && sinc_cutoff(steps[j]) == sinc_cutoff(steps[i]))
+                sincs[i] = sincs[j];
+        }
+        if(sincs[i] == NULL && (sincs[i] = new_sinc(sinc_cutoff(steps[i]))) == NULL){
+            destroy_sincs(sincs, layers);
+            return NULL;
+        }
+    }
+    return sincs;
+}
+
+// destroy the tables from new_sincs, freeing each shared one once
+void destroy_sincs(float** sincs, int layers)
+{
+    if(sincs == NULL)
+        return;
+    for(int i = 0; i < layers; i++){
+        int shared = 0;
+        for(int j = 0; j < i; j++){
+            if(sincs[j] == sincs[i]) shared = 1;
+        }
+        if(sincs[i] && !shared)
+            free(sincs[i]);
+    }
+    free(sincs);
+}
+
+// read the source between two frames
+/*  The two nearest rows of the table are both applied and blended. The
+    dot products are summed four lanes at a time, which the compiler turns
+    into vector instructions while keeping the summing order fixed. */
+float sinc_read(float* sinc, SOURCE* source, unsigned long index, unsigned long frac)
+{
+    unsigned long phase = frac >> (RATE_BITS - 8);
+    float blend = (float)(frac & ((1UL << (RATE_BITS - 8)) - 1)) * (1.0f / (float)(1UL << (RATE_BITS - 8)));
+    float* h0 = sinc + phase * SINC_TAPS;
+    float* h1 = h0 + SINC_TAPS;
+    long first = (long)index - (SINC_TAPS / 2 - 1);
+    float taps[SINC_TAPS];
+    float* x = taps;
+    float lo[4] = {0.0, 0.0, 0.0, 0.0};
+    float hi[4] = {0.0, 0.0, 0.0, 0.0};
+    float a, b;
+
+    if(source->pcm){
+        for(int k = 0; k < SINC_TAPS; k++)
+            taps[k] = source->pcm[first + k] * PCM_SCALE;
+    } else {
+        x = source->frames + first;
+    }
+    for(int k = 0; k < SINC_TAPS; k += 4){
+        for(int j = 0; j < 4; j++){
+            lo[j] += x[k + j] * h0[k + j];
+            hi[j] += x[k + j] * h1[k + j];
+        }
+    }
+    a = (lo[0] + lo[1]) + (lo[2] + lo[3]);
+    b = (hi[0] + hi[1]) + (hi[2] + hi[3]);
+    return a + blend * (b - a);
 }
 
 // initialize and set values for new shard
@@ -22,15 +153,15 @@ void new_shard(SHARD* curshard, long* zc_array, long zc_count, long min, long ma
     double rand_range = ((double)zc_count / (double)RAND_MAX);
 
     // get first values
-    r1 = rand() * rand_range;
+    r1 = rng_next(&curshard->rng) * rand_range;
     val1 = zc_array[(int)(r1 + 0.5)];
-    r2 = rand() * rand_range;
+    r2 = rng_next(&curshard->rng) * rand_range;
     val2 = zc_array[(int)(r2 + 0.5)];
 
     while(abs(val2 - val1) < min || abs(val2 - val1) > max){
-        r1 = rand() * rand_range;
+        r1 = rng_next(&curshard->rng) * rand_range;
         val1 = zc_array[(int)(r1 + 0.5)];
-        r2 = rand() * rand_range;
+        r2 = rng_next(&curshard->rng) * rand_range;
         val2 = zc_array[(int)(r2 + 0.5)];     
     }
 
@@ -45,6 +176,27 @@ void new_shard(SHARD* curshard, long* zc_array, long zc_count, long min, long ma
     curshard->shift = 1.0; // sets the chance of change to its maximum
 }
 
+// check that new_shard can find a pair of split points to use (1 = it can)
+/*  new_shard keeps drawing pairs until one is between min and max frames
+    apart, so without such a pair it would never return. The points are in
+    order, the guard point at zc_count included, so the first point at least
+    min past each one is the only one that needs checking. */
+int shard_possible(long* zc_array, long zc_count, long min, long max)
+{
+    long j = 0;
+
+    for(long i = 0; i <= zc_count; i++){
+        if(j < i) j = i;
+        while(j <= zc_count && zc_array[j] - zc_array[i] < min)
+            j++;
+        if(j > zc_count)
+            return 0;
+        if(zc_array[j] - zc_array[i] <= max)
+            return 1;
+    }
+    return 0;
+}
+
 // set the current shard to start
 void activate_shard(SHARD* curshard)
 {
@@ -72,13 +224,13 @@ void deactivate_all_shards(SHARD** shardarray, int layers){
 }
 
 // get the value from the layer
-float layer_tick(LAYER* layer, float* inframe)
+float layer_tick(LAYER* layer, SOURCE* source)
 {
     float thisframe = 0.0;
     float ampfac = layer->ampfac;
 
     if(layer->play){
-        thisframe = inframe[layer->index] * ampfac;
+        thisframe = source_read(source,layer->index) * ampfac;
         layer->index += 1;
         if(layer->index > layer->size){
             layer->index = 0;
@@ -89,16 +241,24 @@ float layer_tick(LAYER* layer, float* inframe)
 }
 
 // get the value from the layer/shard
-float shard_tick(LAYER* layer, SHARD* shard, float* inframe, int* change_check, double bias)
+float shard_tick(LAYER* layer, SHARD* shard, SOURCE* source, int* change_check, double bias)
 {
     float thisframe = 0.0;
 
     if(layer->play == 1){
-        thisframe = inframe[layer->index] * layer->ampfac;
-        layer->index += 1;
+        if(layer->step == RATE_ONE){
+            thisframe = source_read(source,layer->index) * layer->ampfac;
+            layer->index += 1;
+        } else {
+            thisframe = sinc_read(layer->sinc,source,layer->index,layer->frac) * layer->ampfac;
+            layer->frac += layer->step;
+            layer->index += layer->frac >> RATE_BITS;
+            layer->frac &= RATE_ONE - 1;
+        }
         if(shard->looping){
             if(layer->index > shard->end){
                 layer->index = shard->start;
+                layer->frac = 0;
                 layer->ampfac = layer->sqrfac;
                 if(shift_check(shard,bias)){
                     *change_check = 1;
@@ -107,6 +267,7 @@ float shard_tick(LAYER* layer, SHARD* shard, float* inframe, int* change_check,
         }
         if(layer->index > layer->size){
             layer->index = 0;
+            layer->frac = 0;
             if(shard->looping == 0) layer->play = 0;
         }
     }
@@ -117,7 +278,7 @@ float shard_tick(LAYER* layer, SHARD* shard, float* inframe, int* change_check,
 int shift_check(SHARD* curshard, double bias)
 {
     double inv_randmax = 1.0 / (double)RAND_MAX;
-    double check = rand();
+    double check = rng_next(&curshard->rng);
     double val = curshard->shift;
 
     check *= inv_randmax;
@@ -131,6 +292,262 @@ int shift_check(SHARD* curshard, double bias)
     }    
 }
 
+#define ONSET_HOP (256)     // frames in each step of the energy envelope
+#define ONSET_REACH (8)     // steps either side that the onset threshold is averaged over
+
+// the quietest frame in a stretch of the input
+static long quietest_frame(SOURCE* source, long from, long to)
+{
+    long best = from;
+    float level = fabsf(source_read(source,from));
+
+    for(long i = from + 1; i < to; i++){
+        float here = fabsf(source_read(source,i));
+        if(here < level){
+            level = here;
+            best = i;
+        }
+    }
+    return best;
+}
+
+// add a split point, keeping the array in order and free of repeats
+static int push_point(long** points, long* count, long* capacity, long point)
+{
+    if(*count > 0 && (*points)[*count - 1] >= point)
+        return 0;
+    if(*count + 1 >= *capacity){            // always leave room for the guard point
+        long grown = *capacity ? *capacity * 2 : 64;
+        long* array = (long*)realloc(*points, sizeof(long) * grown);
+        if(array == NULL)
+            return 1;
+        *points = array;
+        *capacity = grown;
+    }
+    (*points)[(*count)++] = point;
+    return 0;
+}
+
+// find split points at onsets and in the energy valleys between them (returns the count)
+/*  The input is cut into steps of ONSET_HOP frames and the energy of each
+    is taken (in dB). An onset is a step whose rise in energy over the last
+    one is a local peak and stands out from the average rise around it by a
+    margin that shrinks as the sensitivity (0 to 1) goes up; the split goes
+    on the quietest frame of the step before it, just ahead of the attack.
+    Between two onsets the quietest step is taken as a valley and split on
+    its quietest frame as well. Returns -1 if memory runs out. */
+long find_onsets(SOURCE* source, long from, long to, double sensitivity, long** points)
+{
+    long steps = (to - from) / ONSET_HOP;
+    double margin = 1.0 + 12.0 * (1.0 - sensitivity);   // in dB
+    float* level = NULL;
+    float* rise = NULL;
+    long count = 0;
+    long capacity = 0;
+    long valley = -1;           // quietest step since the last onset
+
+    *points = NULL;
+    if(steps < 3)
+        return 0;
+    level = (float*)malloc(sizeof(float) * steps);
+    rise = (float*)malloc(sizeof(float) * steps);
+    if(level == NULL || rise == NULL)
+        goto fail;
+
+    // the energy envelope, summed four lanes at a time
+    for(long k = 0; k < steps; k++){
+        long base = from + k * ONSET_HOP;
+        float lanes[4] = {0.0, 0.0, 0.0, 0.0};
+        for(long i = 0; i < ONSET_HOP; i += 4){
+            for(int j = 0; j < 4; j++){
+                float x = source_read(source,base + i + j);
+                lanes[j] += x * x;
+            }
+        }
+        level[k] = 10.0 * log10(((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) / ONSET_HOP + 1e-12);
+    }
+    rise[0] = 0.0;
+    for(long k = 1; k < steps; k++){
+        float diff = level[k] - level[k - 1];
+        rise[k] = (diff > 0.0) ? diff : 0.0;
+    }
+
+    for(long k = 1; k < steps; k++){
+        long lo = (k > ONSET_REACH) ? k - ONSET_REACH : 0;
+        long hi = (k + ONSET_REACH < steps) ? k + ONSET_REACH : steps - 1;
+        double average = 0.0;
+        int onset;
+
+        for(long i = lo; i <= hi; i++)
+            average += rise[i];
+        average /= (hi - lo + 1);
+        onset = rise[k] > average + margin && rise[k] >= rise[k - 1]
+                && (k + 1 >= steps || rise[k] > rise[k + 1]);
+
+        if(onset){
+            long before = from + (k - 1) * ONSET_HOP;
+            if(valley >= 0 && valley < k - 1){
+                long start = from + valley * ONSET_HOP;
+                if(push_point(points,&count,&capacity,quietest_frame(source,start,start + ONSET_HOP)))
+                    goto fail;
+            }
+            if(push_point(points,&count,&capacity,quietest_frame(source,before,before + ONSET_HOP)))
+                goto fail;
+            valley = -1;
+        } else if(valley < 0 || level[k] < level[valley]){
+            valley = k;
+        }
+    }
+    // the stretch after the last onset still gets its valley
+    if(valley >= 0){
+        long start = from + valley * ONSET_HOP;
+        if(push_point(points,&count,&capacity,quietest_frame(source,start,start + ONSET_HOP)))
+            goto fail;
+    }
+
+    free(level);
+    free(rise);
+    return count;
+
+fail:
+    if(level) free(level);
+    if(rise) free(rise);
+    if(*points) free(*points);
+    *points = NULL;
+    return -1;
+}
+
+/************************ PARALLEL LOADING ************************************/
+
+#define LOAD_BLOCK (8192)   // frames each decoding thread reads at a time
+
+typedef struct load_range
+{
+    const char* path;
+    SOURCE* source;
+    long from;              // frames [from, to) of the input this thread decodes
+    long to;
+    int scan;               // which split-point scan runs over the range afterwards
+    double near_zero;
+    long scan_from;         // the scan only looks at [scan_from, scan_to)
+    long scan_to;
+    long* points;
+    long count;
+    long capacity;
+    int error;
+    pthread_t thread;
+} LOAD_RANGE;
+
+// decode one range of the input straight into its place in the source, then scan it
+static void* load_worker(void* arg)
+{
+    LOAD_RANGE* range = (LOAD_RANGE*)arg;
+    SF_INFO info = {0};
+    SNDFILE* file = sf_open(range->path,SFM_READ,&info);
+    long lo, hi;
+
+    if(file == NULL || sf_seek(file,range->from,SEEK_SET) != range->from){
+        range->error++;
+        goto close;
+    }
+    for(long pos = range->from; pos < range->to;){
+        long n = (range->to - pos < LOAD_BLOCK) ? range->to - pos : LOAD_BLOCK;
+        long got = range->source->pcm ? sf_read_short(file,range->source->pcm + pos,n)
+                                      : sf_read_float(file,range->source->frames + pos,n);
+        if(got != n){
+            range->error++;
+            goto close;
+        }
+        pos += n;
+    }
+
+    if(range->scan == SCAN_NONE)
+        goto close;
+    lo = (range->from > range->scan_from) ? range->from : range->scan_from;
+    hi = (range->to < range->scan_to) ? range->to : range->scan_to;
+    for(long i = lo; i < hi; i++){
+        float value = source_read(range->source,i);
+        int hit = (range->scan == SCAN_ZERO) ? (value == 0.0) : (fabs(value) <= range->near_zero);
+        if(hit && push_point(&range->points,&range->count,&range->capacity,i)){
+            range->error++;
+            break;
+        }
+    }
+
+close:
+    if(file) sf_close(file);
+    return NULL;
+}
+
+// decode the input into source over a number of threads and scan it for split points
+/*  Every thread opens the file for itself, seeks to the start of its own
+    range and decodes it straight into its final place in the source, so
+    compressed inputs are decoded on as many cores as there are threads.
+    Once a range is in, its thread scans it for zero (or near zero) points,
+    and the ranges' points are joined in order afterwards, which gives the
+    same points as scanning the whole input in one go. Returns the number
+    of points (with room left for a guard point), or -1 on failure. */
+long load_source(const char* path, SOURCE* source, int threads, int scan, double near_zero,
+                 long from, long to, long** points)
+{
+    LOAD_RANGE* ranges = (LOAD_RANGE*)calloc(threads,sizeof(LOAD_RANGE));
+    long count = 0;
+    int started = 0;
+    int error = 0;
+
+    *points = NULL;
+    if(ranges == NULL)
+        return -1;
+    if(to > (long)source->size)
+        to = source->size;
+    for(int i = 0; i < threads; i++){
+        ranges[i].path = path;
+        ranges[i].source = source;
+        ranges[i].from = (long)(source->size * i / threads);
+        ranges[i].to = (long)(source->size * (i + 1) / threads);
+        ranges[i].scan = scan;
+        ranges[i].near_zero = near_zero;
+        ranges[i].scan_from = from;
+        ranges[i].scan_to = to;
+    }
+    for(started = 0; started < threads; started++){
+        if(pthread_create(&ranges[started].thread,NULL,load_worker,&ranges[started])){
+            error++;
+            break;
+        }
+    }
+    for(int i = 0; i < started; i++){
+        pthread_join(ranges[i].thread,NULL);
+        error += ranges[i].error;
+    }
+
+    // join the points of every range, leaving room for the guard point
+    for(int i = 0; i < threads; i++)
+        count += ranges[i].count;
+    if(!error && scan != SCAN_NONE){
+        *points = (long*)malloc(sizeof(long) * (count + 1));
+        if(*points == NULL){
+            error++;
+        } else {
+            long k = 0;
+            for(int i = 0; i < threads; i++){
+                if(ranges[i].count)
+                    memcpy(*points + k,ranges[i].points,sizeof(long) * ranges[i].count);
+                k += ranges[i].count;
+            }
+        }
+    }
+    for(int i = 0; i < threads; i++)
+        if(ranges[i].points) free(ranges[i].points);
+    free(ranges);
+    if(error){
+        if(*points) free(*points);
+        *points = NULL;
+        return -1;
+    }
+    return (scan != SCAN_NONE) ? count : 0;
+}
+
 // gets data about a shard and prints it to the standard output
 void observe_shard(int layer_num, SHARD* curshard, int srate){
     int layer = layer_num + 1;
@@ -148,20 +565,929 @@ void observe_shard(int layer_num, SHARD* curshard, int srate){
             ,layer,start_secs,start_samp,end_secs,end_samp,length_secs,length_samp);
 }
 
-// layer destruction function
-void destroy_layers(LAYER** thislayer, int layers)
+/************************ RENDER PLAN ************************************/
+
+#define PLAN_MAGIC "SHPLAN02"
+
+// frames a layer plays from pos until it passes frame end (positions are in RATE_ONE units)
+static long plan_run(unsigned long pos, unsigned long end, unsigned long step)
+{
+    unsigned long limit = (end + 1) << RATE_BITS;
+
+    if(pos >= limit)
+        return 1;
+    return (long)((limit - pos + step - 1) / step);
+}
+
+// position of the layer at output frame t, t being inside the span of this shard
+static unsigned long plan_position(PLAN* plan, PLAN_LAYER* pl, PLAN_SHARD* rec, long t)
+{
+    long looping = (t < plan->loopframes ? t : plan->loopframes);
+    long played = looping - rec->time;
+    unsigned long entry = rec->entry << RATE_BITS;
+    unsigned long start = rec->start << RATE_BITS;
+    long first = plan_run(entry, rec->end, pl->step);
+    unsigned long pos;
+
+    if(played < first){
+        pos = entry + played * pl->step;
+    } else {
+        pos = start + ((played - first) % plan_run(start, rec->end, pl->step)) * pl->step;
+    }
+    // no more loops once the shards are deactivated for the tail
+    return pos + (t - looping) * pl->step;
+}
+
+// add a shard to the end of a layer's record
+static int plan_push(PLAN_LAYER* pl, long time, unsigned long entry, SHARD* shard)
+{
+    PLAN_SHARD* rec;
+
+    if(pl->count == pl->capacity){
+        long capacity = pl->capacity ? pl->capacity * 2 : 16;
+        PLAN_SHARD* shards = (PLAN_SHARD*)realloc(pl->shards, sizeof(PLAN_SHARD) * capacity);
+        if(shards == NULL)
+            return 1;
+        pl->shards = shards;
+        pl->capacity = capacity;
+    }
+    rec = &pl->shards[pl->count++];
+    rec->time = time;
+    rec->entry = entry;
+    rec->start = shard->start;
+    rec->end = shard->end;
+    rec->loops = 0;
+
+    return 0;
+}
+
+// find the shard that is playing in a layer at output frame t
+static long plan_find(PLAN_LAYER* pl, long t)
+{
+    long lo = 0;
+    long hi = pl->count - 1;
+
+    while(lo < hi){
+        long mid = (lo + hi + 1) / 2;
+        if(pl->shards[mid].time <= t)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+// record every shard decision for a render without touching any audio
+/*  This walks the loop points of all the layers in the same order as the
+    render loop in shatter.c ticks them (by frame, then by layer), so the
+    random numbers are drawn in the same sequence and the plan matches what
+    the sequential render would have played. */
+PLAN* plan_shatter(long* zc_array, long zc_count, long min, long max, double bias, int layers,
+                   RNG* rngs, unsigned long* steps, unsigned long filesize, int srate, int outrate,
+                   long totalsamples, int tail, int nframes, int list_shards)
+{
+    PLAN* plan = (PLAN*)calloc(1, sizeof(PLAN));
+    SHARD* shard = (SHARD*)malloc(sizeof(SHARD) * layers);
+    long* next = (long*)malloc(sizeof(long) * layers);     // frame of each layer's next loop point
+    long tailframes = 0;
+
+    if(plan == NULL || shard == NULL || next == NULL)
+        goto fail;
+    plan->layer = (PLAN_LAYER*)calloc(layers, sizeof(PLAN_LAYER));
+    if(plan->layer == NULL)
+        goto fail;
+    plan->layers = layers;
+    plan->srate = srate;
+    plan->outrate = outrate;
+    plan->size = filesize;
+    // the render loop always writes whole blocks
+    plan->loopframes = ((totalsamples + nframes - 1) / nframes) * nframes;
+
+    for(int i = 0; i < layers; i++){
+        shard[i].rng = rngs[i];
+        new_shard(&shard[i],zc_array,zc_count,min,max);
+        if(list_shards){
+            observe_shard(i,&shard[i],srate);
+        }
+        activate_shard(&shard[i]);
+        if(plan_push(&plan->layer[i],0,0,&shard[i]))
+            goto fail;
+        plan->layer[i].step = steps[i];
+        plan->layer[i].gainswitch = LONG_MAX;
+        next[i] = plan_run(0,shard[i].end,steps[i]) - 1;
+    }
+
+    for(;;){
+        PLAN_LAYER* pl;
+        long tick;
+        int j = 0;
+
+        for(int i = 1; i < layers; i++){
+            if(next[i] < next[j]) j = i;
+        }
+        tick = next[j];
+        if(tick >= plan->loopframes) break;
+
+        pl = &plan->layer[j];
+        pl->shards[pl->count - 1].loops++;
+        if(pl->gainswitch == LONG_MAX)
+            pl->gainswitch = tick + 1;
+        if(shift_check(&shard[j],bias)){
+            unsigned long entry = shard[j].start;
+            new_shard(&shard[j],zc_array,zc_count,min,max);
+            if(list_shards) observe_shard(j,&shard[j],srate);
+            activate_shard(&shard[j]);
+            if(plan_push(pl,tick + 1,entry,&shard[j]))
+                goto fail;
+            next[j] = tick + plan_run(entry << RATE_BITS,shard[j].end,pl->step);
+        } else {
+            next[j] = tick + plan_run(shard[j].start << RATE_BITS,shard[j].end,pl->step);
+        }
+    }
+
+    // the tail plays each layer on to the end of the file
+    for(int i = 0; i < layers; i++){
+        PLAN_LAYER* pl = &plan->layer[i];
+        unsigned long pos = plan_position(plan,pl,&pl->shards[pl->count - 1],plan->loopframes);
+        long left = plan_run(pos,filesize,pl->step);
+
+        pl->stop = plan->loopframes + left;
+        if(left > tailframes) tailframes = left;
+    }
+    plan->totalframes = plan->loopframes;
+    if(tail)
+        plan->totalframes += ((tailframes + nframes - 1) / nframes) * nframes;
+    // without a tail the layers are cut off at the end of the loop
+    for(int i = 0; i < layers; i++){
+        if(plan->layer[i].gainswitch == LONG_MAX)
+            plan->layer[i].gainswitch = plan->totalframes;
+        if(plan->layer[i].stop > plan->totalframes)
+            plan->layer[i].stop = plan->totalframes;
+    }
+
+    free(shard);
+    free(next);
+    return plan;
+
+fail:
+    if(shard) free(shard);
+    if(next) free(next);
+    destroy_plan(plan);
+    return NULL;
+}
+
+// add frames [from, from + count) of one layer of a plan into out
+void plan_render_layer(PLAN* plan, int j, SOURCE* source, float* out, long from, long count)
 {
-    for(int i = 0; i > layers; i++){
-        free(thislayer[i]);
+    double ampfac = (1.0 / (double)plan->layers);
+    double sqrfac = (1.0 / sqrt((double)plan->layers));
+    long last = from + count;
+    PLAN_LAYER* pl = &plan->layer[j];
+    long r = plan_find(pl,from);
+    long t = from;
+
+    while(t < last && t < pl->stop){
+        PLAN_SHARD* rec;
+        unsigned long pos;
+        double gain;
+        float* src;
+        short* pcm;
+        float* dst;
+        long n = last - t;
+
+        while(r + 1 < pl->count && pl->shards[r + 1].time <= t)
+            r++;
+        rec = &pl->shards[r];
+        pos = plan_position(plan,pl,rec,t);
+
+        // play until something changes: the shard, the gain, a loop point or the end
+        if(r + 1 < pl->count && pl->shards[r + 1].time - t < n)
+            n = pl->shards[r + 1].time - t;
+        if(pl->stop - t < n)
+            n = pl->stop - t;
+        if(t < pl->gainswitch && pl->gainswitch - t < n)
+            n = pl->gainswitch - t;
+        if(t < plan->loopframes){
+            long played = t - rec->time;
+            long first = plan_run(rec->entry << RATE_BITS,rec->end,pl->step);
+            long loop = plan_run(rec->start << RATE_BITS,rec->end,pl->step);
+            long left = (played < first) ? first - played : loop - (played - first) % loop;
+
+            if(left < n) n = left;
+            if(plan->loopframes - t < n) n = plan->loopframes - t;
+        }
+
+        gain = (t < pl->gainswitch) ? ampfac : sqrfac;
+        dst = out + (t - from);
+        if(pl->step == RATE_ONE && source->pcm){
+            // 16-bit samples are turned into floats right here in the mix
+            pcm = source->pcm + (pos >> RATE_BITS);
+            for(long i = 0; i < n; i++){
+                float thisframe = (pcm[i] * PCM_SCALE) * gain;
+                dst[i] += thisframe;
+            }
+        } else if(pl->step == RATE_ONE){
+            src = source->frames + (pos >> RATE_BITS);
+            for(long i = 0; i < n; i++){
+                float thisframe = src[i] * gain;
+                dst[i] += thisframe;
+            }
+        } else {
+            for(long i = 0; i < n; i++){
+                float thisframe = sinc_read(pl->sinc,source,pos >> RATE_BITS,pos & (RATE_ONE - 1)) * gain;
+                dst[i] += thisframe;
+                pos += pl->step;
+            }
+        }
+        t += n;
     }
-    free(thislayer);
 }
 
-// shard destruction function
-void destroy_shards(SHARD** thisshard, int layers)
+// render frames [from, from + count) of a plan into out
+/*  Layers are summed one after the other into out, which adds them in the
+    same order as shard_tick does, so any range renders bit-identically to
+    the same frames of a sequential render. */
+void plan_render(PLAN* plan, SOURCE* source, float* out, long from, long count)
 {
-    for(int i = 0; i > layers; i++){
-        free(thisshard[i]);
+    plan_render_channels(plan,source,out,from,count,1,count);
+}
+
+// render frames [from, from + count) of a plan with its layers spread over a number of channels
+/*  Layer j goes into channel j * channels / layers, so neighbouring layers
+    share a channel and each channel is summed in the same order as the
+    mix. Each channel's frames start stride floats after the last one's. */
+void plan_render_channels(PLAN* plan, SOURCE* source, float* out, long from, long count, int channels, long stride)
+{
+    for(int c = 0; c < channels; c++){
+        for(long i = 0; i < count; i++){
+            out[c * stride + i] = 0.0;
+        }
     }
-    free(thisshard);
-}
\ No newline at end of file
+
+    for(int j = 0; j < plan->layers; j++){
+        int c = (int)((long)j * channels / plan->layers);
+        plan_render_layer(plan,j,source,out + c * stride,from,count);
+    }
+}
+
+// render one job's slice, all the layers over channels or a single layer on its own
+static void plan_job_render(PLAN_JOB* job)
+{
+    if(job->layer < 0){
+        plan_render_channels(job->plan,job->source,job->out,job->from,job->count,job->channels,job->stride);
+    } else {
+        for(long i = 0; i < job->count; i++){
+            job->out[i] = 0.0;
+        }
+        plan_render_layer(job->plan,job->layer,job->source,job->out,job->from,job->count);
+    }
+}
+
+// thread entry point for rendering one slice of a plan, once per pass until the pool stops
+static void* plan_worker(void* arg)
+{
+    PLAN_JOB* job = (PLAN_JOB*)arg;
+    RENDER_POOL* pool = job->pool;
+
+    for(;;){
+        pthread_mutex_lock(&pool->lock);
+        while(pool->generation == job->generation && !pool->quit)
+            pthread_cond_wait(&pool->go, &pool->lock);
+        if(pool->quit){
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        job->generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        plan_job_render(job);
+
+        pthread_mutex_lock(&pool->lock);
+        if(--pool->pending == 0)
+            pthread_cond_signal(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+// bytes a render pool for a number of threads takes up in an arena
+size_t render_pool_footprint(int threads)
+{
+    return arena_round(sizeof(RENDER_POOL)) + arena_round(sizeof(PLAN_JOB) * threads);
+}
+
+// lay out a render pool in an arena and start its threads
+/*  The last slice of each pass is rendered by the caller, so threads - 1
+    workers are started. Slices for any that can't be started go to the
+    caller as well. */
+RENDER_POOL* new_render_pool(ARENA* arena, int threads)
+{
+    RENDER_POOL* pool = (RENDER_POOL*)arena_alloc(arena, sizeof(RENDER_POOL));
+
+    if(pool == NULL)
+        return NULL;
+    pool->jobs = (PLAN_JOB*)arena_alloc(arena, sizeof(PLAN_JOB) * threads);
+    if(pool->jobs == NULL)
+        return NULL;
+    pool->threads = threads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->go, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for(int i = 0; i < threads - 1; i++){
+        PLAN_JOB* job = &pool->jobs[i];
+        job->pool = pool;
+        if(pthread_create(&job->thread, NULL, plan_worker, job) != 0)
+            break;
+        pool->running++;
+    }
+    return pool;
+}
+
+// hand each of the pool's threads a slice of frames [from, from + count) and wait for them all
+static void plan_dispatch(RENDER_POOL* pool, PLAN* plan, int layer, SOURCE* source, float* out,
+                          long from, long count, int channels)
+{
+    long share;
+
+    // slices start on cache lines of their own, so no two threads write to the same one
+    share = (count + pool->threads - 1) / pool->threads;
+    share = arena_round(sizeof(float) * share) / sizeof(float);
+    pthread_mutex_lock(&pool->lock);
+    for(int i = 0; i < pool->threads; i++){
+        PLAN_JOB* job = &pool->jobs[i];
+        long begin = i * share;
+        long n = (begin + share < count) ? share : count - begin;
+
+        job->plan = plan;
+        job->source = source;
+        job->out = out + begin;
+        job->from = from + begin;
+        job->count = (n > 0) ? n : 0;
+        job->layer = layer;
+        job->channels = channels;
+        job->stride = count;
+    }
+    pool->generation++;
+    pool->pending = pool->running;
+    pthread_cond_broadcast(&pool->go);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(int i = pool->running; i < pool->threads; i++)
+        plan_job_render(&pool->jobs[i]);
+    pthread_mutex_lock(&pool->lock);
+    while(pool->pending)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// render frames [from, from + count) of a plan, split over the pool's threads
+void plan_render_parallel(RENDER_POOL* pool, PLAN* plan, SOURCE* source, float* out, long from, long count, int channels)
+{
+    if(pool == NULL || pool->threads < 2)
+        plan_render_channels(plan,source,out,from,count,channels,count);
+    else
+        plan_dispatch(pool,plan,-1,source,out,from,count,channels);
+}
+
+// render frames [from, from + count) of layer j of a plan on its own into out, split over the pool's threads
+void plan_render_layer_parallel(RENDER_POOL* pool, PLAN* plan, int j, SOURCE* source, float* out, long from, long count)
+{
+    if(pool == NULL || pool->threads < 2){
+        for(long i = 0; i < count; i++){
+            out[i] = 0.0;
+        }
+        plan_render_layer(plan,j,source,out,from,count);
+    } else {
+        plan_dispatch(pool,plan,j,source,out,from,count,1);
+    }
+}
+
+// stop the pool's threads (the pool itself goes with its arena)
+void destroy_render_pool(RENDER_POOL* pool)
+{
+    if(pool){
+        pthread_mutex_lock(&pool->lock);
+        pool->quit = 1;
+        pthread_cond_broadcast(&pool->go);
+        pthread_mutex_unlock(&pool->lock);
+        for(int i = 0; i < pool->running; i++)
+            pthread_join(pool->jobs[i].thread, NULL);
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->go);
+        pthread_cond_destroy(&pool->done);
+    }
+}
+
+// write the plan to a file (returns 0 on success)
+/*  Layout: magic, then the plan header as longs, then for each layer its
+    header followed by its shards, all in native byte order. */
+int plan_save(PLAN* plan, const char* path)
+{
+    FILE* fp = fopen(path,"wb");
+    int error = 0;
+
+    if(fp == NULL)
+        return 1;
+    long head[6] = {plan->layers, plan->srate, plan->outrate, (long)plan->size, plan->loopframes, plan->totalframes};
+    if(fwrite(PLAN_MAGIC,1,8,fp) != 8 || fwrite(head,sizeof(long),6,fp) != 6)
+        error++;
+    for(int i = 0; i < plan->layers && !error; i++){
+        PLAN_LAYER* pl = &plan->layer[i];
+        long lhead[4] = {pl->count, (long)pl->step, pl->gainswitch, pl->stop};
+        if(fwrite(lhead,sizeof(long),4,fp) != 4
+           || fwrite(pl->shards,sizeof(PLAN_SHARD),pl->count,fp) != (size_t)pl->count)
+            error++;
+    }
+    if(fclose(fp))
+        error++;
+
+    return error;
+}
+
+// read a plan back from a file (NULL on failure)
+PLAN* plan_load(const char* path)
+{
+    FILE* fp = fopen(path,"rb");
+    PLAN* plan = NULL;
+    char magic[8];
+    long head[6];
+    long bytes;
+
+    if(fp == NULL)
+        return NULL;
+    // the file's size caps the counts in it, so a corrupt one can't ask for more memory than that
+    if(fseek(fp,0,SEEK_END) || (bytes = ftell(fp)) < 0 || fseek(fp,0,SEEK_SET))
+        goto fail;
+    if(fread(magic,1,8,fp) != 8 || memcmp(magic,PLAN_MAGIC,8) != 0
+       || fread(head,sizeof(long),6,fp) != 6)
+        goto fail;
+    // every number the renderer indexes or loops with has to make sense before it is trusted
+    if(head[0] <= 0 || head[0] > (bytes - ftell(fp)) / (long)(4 * sizeof(long))
+       || head[1] <= 0 || head[2] <= 0 || head[3] <= 0 || head[3] >= (1L << (63 - RATE_BITS))
+       || head[5] < 0 || head[4] < 0 || head[4] > head[5])
+        goto fail;
+    plan = (PLAN*)calloc(1, sizeof(PLAN));
+    if(plan == NULL)
+        goto fail;
+    plan->layers = head[0];
+    plan->srate = head[1];
+    plan->outrate = head[2];
+    plan->size = head[3];
+    plan->loopframes = head[4];
+    plan->totalframes = head[5];
+    plan->layer = (PLAN_LAYER*)calloc(plan->layers, sizeof(PLAN_LAYER));
+    if(plan->layer == NULL)
+        goto fail;
+    for(int i = 0; i < plan->layers; i++){
+        PLAN_LAYER* pl = &plan->layer[i];
+        long lhead[4];
+        if(fread(lhead,sizeof(long),4,fp) != 4
+           || lhead[0] <= 0 || lhead[0] > (bytes - ftell(fp)) / (long)sizeof(PLAN_SHARD)
+           || lhead[1] <= 0 || (unsigned long)lhead[1] > STEP_MAX
+           || lhead[2] < 0 || lhead[2] > plan->totalframes
+           || lhead[3] < 0 || lhead[3] > plan->totalframes)
+            goto fail;
+        pl->count = pl->capacity = lhead[0];
+        pl->step = lhead[1];
+        pl->gainswitch = lhead[2];
+        pl->stop = lhead[3];
+        pl->shards = (PLAN_SHARD*)malloc(sizeof(PLAN_SHARD) * pl->count);
+        if(pl->shards == NULL || fread(pl->shards,sizeof(PLAN_SHARD),pl->count,fp) != (size_t)pl->count)
+            goto fail;
+        // shards take over in time order from the start of the output, while the layer is looping,
+        // and a shard pointing past the source would read outside of it
+        if(pl->shards[0].time != 0)
+            goto fail;
+        for(long k = 0; k < pl->count; k++){
+            PLAN_SHARD* rec = &pl->shards[k];
+            if(rec->time < 0 || rec->time > plan->loopframes
+               || (k > 0 && rec->time < pl->shards[k - 1].time)
+               || rec->end > plan->size || rec->entry > plan->size
+               || rec->start > rec->end || rec->loops < 0)
+                goto fail;
+        }
+        // the tail must stop where the last shard runs off the end of the source
+        if(pl->stop > plan->loopframes
+           + plan_run(plan_position(plan,pl,&pl->shards[pl->count - 1],plan->loopframes),plan->size,pl->step))
+            goto fail;
+    }
+    fclose(fp);
+    return plan;
+
+fail:
+    fclose(fp);
+    destroy_plan(plan);
+    return NULL;
+}
+
+// plan destruction function
+void destroy_plan(PLAN* plan)
+{
+    if(plan){
+        if(plan->layer){
+            for(int i = 0; i < plan->layers; i++){
+                if(plan->layer[i].shards) free(plan->layer[i].shards);
+            }
+            free(plan->layer);
+        }
+        free(plan);
+    }
+}
+
+/************************ CHECKPOINTS ************************************/
+
+#define CHECKPOINT_MAGIC "SHCKPT02"
+
+// write a checkpoint, replacing the old one only once the new one is complete
+int checkpoint_save(CHECKPOINT* ckpt, const char* path)
+{
+    char* temp = (char*)malloc(strlen(path) + 5);
+    FILE* fp;
+    int error = 0;
+
+    if(temp == NULL)
+        return 1;
+    sprintf(temp,"%s.tmp",path);
+    fp = fopen(temp,"wb");
+    if(fp == NULL){
+        free(temp);
+        return 1;
+    }
+    long head[9] = {ckpt->frames, ckpt->totalframes, (long)ckpt->size, ckpt->srate,
+                    ckpt->outrate, ckpt->layers, ckpt->format, ckpt->mapped, ckpt->offset};
+    if(fwrite(CHECKPOINT_MAGIC,1,8,fp) != 8 || fwrite(head,sizeof(long),9,fp) != 9)
+        error++;
+    if(fflush(fp) || fsync(fileno(fp)))
+        error++;
+    if(fclose(fp))
+        error++;
+    if(!error && rename(temp,path))
+        error++;
+    if(error)
+        remove(temp);
+    free(temp);
+
+    return error;
+}
+
+// read a checkpoint back (returns 0 on success)
+int checkpoint_load(CHECKPOINT* ckpt, const char* path)
+{
+    FILE* fp = fopen(path,"rb");
+    char magic[8];
+    long head[9];
+    int error = 0;
+
+    if(fp == NULL)
+        return 1;
+    if(fread(magic,1,8,fp) != 8 || memcmp(magic,CHECKPOINT_MAGIC,8) != 0
+       || fread(head,sizeof(long),9,fp) != 9 || head[0] < 0 || head[0] > head[1])
+        error++;
+    fclose(fp);
+    if(error)
+        return 1;
+    ckpt->frames = head[0];
+    ckpt->totalframes = head[1];
+    ckpt->size = head[2];
+    ckpt->srate = head[3];
+    ckpt->outrate = head[4];
+    ckpt->layers = head[5];
+    ckpt->format = head[6];
+    ckpt->mapped = head[7];
+    ckpt->offset = head[8];
+
+    return 0;
+}
+
+// remove a checkpoint, along with anything left of one being written
+void checkpoint_remove(const char* path)
+{
+    char* temp = (char*)malloc(strlen(path) + 5);
+
+    remove(path);
+    if(temp){
+        sprintf(temp,"%s.tmp",path);
+        remove(temp);
+        free(temp);
+    }
+}
+
+/************************ STEM CACHE ************************************/
+
+#define STEM_MAGIC "SHSTEM01"
+#define FNV_BASIS (0xCBF29CE484222325ULL)
+#define FNV_PRIME (0x100000001B3ULL)
+
+// fold some bytes into a running FNV-1a hash
+static unsigned long long fnv(unsigned long long hash, const void* data, size_t bytes)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    for(size_t i = 0; i < bytes; i++){
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// hash the audio of the source, the same whether it is kept as floats or 16-bit
+unsigned long long source_hash(SOURCE* source)
+{
+    unsigned long long hash = fnv(FNV_BASIS, &source->size, sizeof(source->size));
+    for(unsigned long i = 0; i < source->size; i++){
+        float frame = source_read(source, i);
+        hash = fnv(hash, &frame, sizeof(frame));
+    }
+    return hash;
+}
+
+// the key of a layer's stem: everything that goes into rendering it
+/*  The gain switch is clipped to the stem's length, as a switch after the
+    layer stops changes nothing, and the layer's sinc table only counts when
+    it plays off the original rate. */
+static unsigned long long stem_key(PLAN* plan, int j, unsigned long long hash, long length)
+{
+    PLAN_LAYER* pl = &plan->layer[j];
+    long gainswitch = (pl->gainswitch < length) ? pl->gainswitch : length;
+    long head[9] = {plan->layers, plan->srate, plan->outrate, (long)plan->size, plan->loopframes,
+                    length, (long)pl->step, gainswitch, pl->count};
+    unsigned long long key = fnv(FNV_BASIS, STEM_MAGIC, 8);
+
+    key = fnv(key, &hash, sizeof(hash));
+    key = fnv(key, head, sizeof(head));
+    key = fnv(key, pl->shards, sizeof(PLAN_SHARD) * pl->count);
+    if(pl->step != RATE_ONE && pl->sinc)
+        key = fnv(key, pl->sinc, sizeof(float) * (SINC_PHASES + 1) * SINC_TAPS);
+    return key;
+}
+
+// find each layer's stem in the cache, or get ready to render it there
+STEM_CACHE* open_stems(PLAN* plan, unsigned long long hash, const char* dir, long size)
+{
+    STEM_CACHE* stems = (STEM_CACHE*)calloc(1, sizeof(STEM_CACHE));
+    size_t pathsize = strlen(dir) + 64;
+
+    if(stems == NULL)
+        return NULL;
+    stems->layers = plan->layers;
+    stems->size = size;
+    stems->length = (long*)calloc(plan->layers, sizeof(long));
+    stems->done = (long*)calloc(plan->layers, sizeof(long));
+    stems->fresh = (int*)calloc(plan->layers, sizeof(int));
+    stems->files = (FILE**)calloc(plan->layers, sizeof(FILE*));
+    stems->paths = (char**)calloc(plan->layers, sizeof(char*));
+    stems->temps = (char**)calloc(plan->layers, sizeof(char*));
+    // (the scratch is split between the render threads on cache line boundaries)
+    stems->scratch = (float*)aligned_alloc(ARENA_ALIGN, arena_round(sizeof(float) * size));
+    if(stems->length == NULL || stems->done == NULL || stems->fresh == NULL || stems->files == NULL
+       || stems->paths == NULL || stems->temps == NULL || stems->scratch == NULL)
+        goto fail;
+    if(mkdir(dir, 0755) && errno != EEXIST)
+        goto fail;
+
+    for(int j = 0; j < plan->layers; j++){
+        long length = (plan->layer[j].stop < plan->totalframes) ? plan->layer[j].stop : plan->totalframes;
+        unsigned long long key = stem_key(plan, j, hash, length);
+        char magic[8];
+        unsigned long long check = 0;
+        long frames = -1;
+
+        stems->length[j] = length;
+        stems->paths[j] = (char*)malloc(pathsize);
+        stems->temps[j] = (char*)malloc(pathsize);
+        if(stems->paths[j] == NULL || stems->temps[j] == NULL)
+            goto fail;
+        sprintf(stems->paths[j], "%s/%016llx.stem", dir, key);
+        sprintf(stems->temps[j], "%s/%016llx.%d.tmp", dir, key, (int)getpid());
+
+        // a stem is only taken if it is whole and was made for this key
+        stems->files[j] = fopen(stems->paths[j], "rb");
+        if(stems->files[j]){
+            if(fread(magic, 1, 8, stems->files[j]) != 8 || memcmp(magic, STEM_MAGIC, 8) != 0
+               || fread(&check, sizeof(check), 1, stems->files[j]) != 1 || check != key
+               || fread(&frames, sizeof(frames), 1, stems->files[j]) != 1 || frames != length
+               || fseek(stems->files[j], 0, SEEK_END) || ftell(stems->files[j]) != (long)(24 + sizeof(float) * length)){
+                fclose(stems->files[j]);
+                stems->files[j] = NULL;
+            } else {
+                stems->cached++;
+                continue;
+            }
+        }
+        stems->fresh[j] = 1;
+        stems->files[j] = fopen(stems->temps[j], "wb");
+        if(stems->files[j] == NULL || fwrite(STEM_MAGIC, 1, 8, stems->files[j]) != 8
+           || fwrite(&key, sizeof(key), 1, stems->files[j]) != 1
+           || fwrite(&length, sizeof(length), 1, stems->files[j]) != 1)
+            goto fail;
+    }
+    return stems;
+
+fail:
+    close_stems(stems, 0);
+    return NULL;
+}
+
+// render frames [from, from + count) by summing the stems, rendering the ones not in the cache
+/*  Each stem holds one layer added onto silence, and the stems are summed
+    in layer order, so the mix comes out the same as plan_render. A new
+    stem is rendered a stretch of time to each of the pool's threads. */
+int stem_render(STEM_CACHE* stems, RENDER_POOL* pool, PLAN* plan, SOURCE* source, float* out, long from, long count)
+{
+    float* scratch = stems->scratch;
+
+    for(long i = 0; i < count; i++){
+        out[i] = 0.0;
+    }
+    for(int j = 0; j < stems->layers; j++){
+        long n = stems->length[j] - from;
+        if(n > count) n = count;
+        if(n <= 0)
+            continue;       // the layer has stopped
+
+        if(stems->fresh[j]){
+            plan_render_layer_parallel(pool, plan, j, source, scratch, from, n);
+            // a stem can only be written from its start (not after a resume, say)
+            if(stems->files[j] && stems->done[j] == from){
+                if(fwrite(scratch, sizeof(float), n, stems->files[j]) != (size_t)n)
+                    return 1;
+                stems->done[j] += n;
+            }
+        } else {
+            if(fseek(stems->files[j], 24 + sizeof(float) * from, SEEK_SET)
+               || fread(scratch, sizeof(float), n, stems->files[j]) != (size_t)n)
+                return 1;
+        }
+        for(long i = 0; i < n; i++){
+            out[i] += scratch[i];
+        }
+    }
+    return 0;
+}
+
+// close the stems, keeping the new ones in the cache if they were rendered all the way through
+int close_stems(STEM_CACHE* stems, int keep)
+{
+    int error = 0;
+
+    if(stems == NULL)
+        return 0;
+    for(int j = 0; j < stems->layers; j++){
+        if(stems->files && stems->files[j]){
+            if(fclose(stems->files[j]))
+                error++;
+            if(stems->fresh[j]){
+                if(keep && !error && stems->done[j] == stems->length[j])
+                    error += (rename(stems->temps[j], stems->paths[j]) != 0);
+                else
+                    remove(stems->temps[j]);
+            }
+        }
+        if(stems->paths && stems->paths[j]) free(stems->paths[j]);
+        if(stems->temps && stems->temps[j]) free(stems->temps[j]);
+    }
+    if(stems->length) free(stems->length);
+    if(stems->done) free(stems->done);
+    if(stems->fresh) free(stems->fresh);
+    if(stems->files) free(stems->files);
+    if(stems->paths) free(stems->paths);
+    if(stems->temps) free(stems->temps);
+    if(stems->scratch) free(stems->scratch);
+    free(stems);
+    return error;
+}
+
+/************************ WEAVE CHAIN ************************************/
+
+// weave each block as it comes in and write it out
+static void* chain_worker(void* arg)
+{
+    CHAIN* chain = (CHAIN*)arg;
+
+    // the flush mode belongs to the thread, and the feedback tail decays into denormals
+    denormals_off();
+    pthread_mutex_lock(&chain->lock);
+    for(;;){
+        while(chain->filled == 0 && !chain->finished)
+            pthread_cond_wait(&chain->ready,&chain->lock);
+        if(chain->filled == 0)
+            break;
+        int slot = chain->first;
+        long count = chain->counts[slot];
+        pthread_mutex_unlock(&chain->lock);
+
+        float* in = chain->blocks + (long)slot * chain->size;
+        float* out = chain->mapout ? map_frames(chain->mapout,chain->written) : NULL;
+        if(out == NULL)
+            out = chain->wet;
+        int failed = 0;
+        weave_process(chain->weave,in,out,count);
+        if(chain->mapout){
+            if(map_write(chain->mapout,out,chain->written,count) != count)
+                failed = 1;
+        } else if(sf_write_float(chain->outfile,out,count) != count){
+            failed = 1;
+        }
+        chain->written += count;
+
+        // chain_write checks the error under the lock
+        pthread_mutex_lock(&chain->lock);
+        chain->error += failed;
+        chain->first = (slot + 1) % CHAIN_BLOCKS;
+        chain->filled--;
+        pthread_cond_signal(&chain->space);
+    }
+    pthread_mutex_unlock(&chain->lock);
+    return NULL;
+}
+
+// start a weave with the default patch, writing to outfile or mapout
+CHAIN* new_chain(int srate, int size, SNDFILE* outfile, MAPOUT* mapout)
+{
+    CHAIN* chain = (CHAIN*)calloc(1,sizeof(CHAIN));
+
+    if(chain == NULL)
+        return NULL;
+    chain->size = size;
+    chain->outfile = outfile;
+    chain->mapout = mapout;
+    chain->weave = new_weave(0.25, 0.4, srate);
+    chain->blocks = (float*)malloc(sizeof(float) * size * CHAIN_BLOCKS);
+    chain->wet = (float*)malloc(sizeof(float) * size);
+    if(chain->weave == NULL || chain->weave->delayA == NULL || chain->weave->delayB == NULL
+       || chain->blocks == NULL || chain->wet == NULL){
+        destroy_chain(chain);
+        return NULL;
+    }
+    weave_default(chain->weave,srate);
+
+    pthread_mutex_init(&chain->lock,NULL);
+    pthread_cond_init(&chain->ready,NULL);
+    pthread_cond_init(&chain->space,NULL);
+    if(pthread_create(&chain->thread,NULL,chain_worker,chain)){
+        pthread_mutex_destroy(&chain->lock);
+        pthread_cond_destroy(&chain->ready);
+        pthread_cond_destroy(&chain->space);
+        destroy_chain(chain);
+        return NULL;
+    }
+    chain->running = 1;
+    return chain;
+}
+
+// hand count frames to the weave
+long chain_write(CHAIN* chain, float* frames, long count)
+{
+    for(long done = 0; done < count;){
+        long n = (count - done < chain->size) ? count - done : chain->size;
+        int slot;
+
+        pthread_mutex_lock(&chain->lock);
+        while(chain->filled == CHAIN_BLOCKS)
+            pthread_cond_wait(&chain->space,&chain->lock);
+        slot = (chain->first + chain->filled) % CHAIN_BLOCKS;
+        pthread_mutex_unlock(&chain->lock);
+
+        memcpy(chain->blocks + (long)slot * chain->size,frames + done,sizeof(float) * n);
+        chain->counts[slot] = n;
+
+        pthread_mutex_lock(&chain->lock);
+        chain->filled++;
+        pthread_cond_signal(&chain->ready);
+        if(chain->error){
+            pthread_mutex_unlock(&chain->lock);
+            return 0;
+        }
+        pthread_mutex_unlock(&chain->lock);
+        done += n;
+    }
+    return count;
+}
+
+// wait for the weave to catch up and stop it
+int finish_chain(CHAIN* chain)
+{
+    if(chain->running){
+        pthread_mutex_lock(&chain->lock);
+        chain->finished = 1;
+        pthread_cond_signal(&chain->ready);
+        pthread_mutex_unlock(&chain->lock);
+        pthread_join(chain->thread,NULL);
+        pthread_mutex_destroy(&chain->lock);
+        pthread_cond_destroy(&chain->ready);
+        pthread_cond_destroy(&chain->space);
+        chain->running = 0;
+    }
+    return chain->error;
+}
+
+// chain destruction function
+void destroy_chain(CHAIN* chain)
+{
+    if(chain == NULL)
+        return;
+    finish_chain(chain);
+    unravel(chain->weave);
+    if(chain->blocks) free(chain->blocks);
+    if(chain->wet) free(chain->wet);
+    free(chain);
+}
@@ -1,9 +1,49 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "weave_dat.h"
+#include "mapout.h"
+
+#define RATE_BITS (32)                  // fractional bits of a playback position
+#define RATE_ONE (1UL << RATE_BITS)     // playback step at the original rate
+#define STEP_MAX (RATE_ONE << 24)       // fastest playback step (keeps positions inside 64 bits)
+#define SINC_TAPS (16)                  // source frames each interpolated frame is made from
+#define SINC_PHASES (256)               // fractional positions the sinc table is worked out for
+#define PCM_SCALE (1.0f / 32768.0f)     // 16-bit sample to float, the same as libsndfile reads it
+
+// the audio being shattered, kept either as floats or as 16-bit samples
+typedef struct source
+{
+    unsigned long size;     // the number of frames in the audio file
+    float* frames;          // the audio as floats (NULL when kept as 16-bit)
+    short* pcm;             // the audio as 16-bit samples (NULL when kept as floats)
+} SOURCE;
+
+// read one frame of the source
+static inline float source_read(SOURCE* source, long index)
+{
+    return source->pcm ? source->pcm[index] * PCM_SCALE : source->frames[index];
+}
+
+// a random number stream of its own for each layer (splitmix64)
+typedef unsigned long long RNG;
+
+// the next number from a stream, between 0 and RAND_MAX like rand()
+static inline int rng_next(RNG* rng)
+{
+    unsigned long long z = (*rng += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return (int)(z % ((unsigned long long)RAND_MAX + 1));
+}
+
 typedef struct shard
 {
     int looping;            // a flag to check whether the shard is currently looping
     unsigned long start;    // the start point of the current shard
     unsigned long end;      // the end point of the current shard
     double shift;           // the chance (x:1) that the shard won't change for the next loop
+    RNG rng;                // the layer's random numbers, so layers can be reseeded one at a time
 } SHARD;
 
 typedef struct layer
@@ -13,14 +53,35 @@ typedef struct layer
     double ampfac;          // amplitude of the layer - usually 1.0/(number of layers)
     double sqrfac;          // amplitude of the layer - replaces ampfac when the shard plays
     unsigned long index;    // position in the audio file
+    unsigned long frac;     // fraction of a frame past index (out of RATE_ONE)
+    unsigned long step;     // how far index moves each frame (RATE_ONE = original pitch)
+    float* sinc;            // interpolation table for steps other than RATE_ONE
 } LAYER;
 
+// the random number stream a layer starts from for a given seed
+RNG layer_seed(unsigned long seed, int layer);
+
 // initalize audio layer
-void layer_init(LAYER* curlayer, int layers, unsigned long filesize);
+void layer_init(LAYER* curlayer, int layers, unsigned long filesize, unsigned long step, float* sinc);
+
+// build the polyphase windowed-sinc table (cutoff as a fraction of the source's nyquist)
+float* new_sinc(double cutoff);
+
+// build the interpolation table of each layer, sharing equal ones (NULL for layers at RATE_ONE)
+float** new_sincs(unsigned long* steps, int layers);
+
+// destroy the tables from new_sincs
+void destroy_sincs(float** sincs, int layers);
+
+// read the source between two frames
+float sinc_read(float* sinc, SOURCE* source, unsigned long index, unsigned long frac);
 
 // initialize and set values for new shard
 void new_shard(SHARD* curshard, long* zc_array, long zc_count, long min, long max);
 
+// check that some pair of split points makes a shard between min and max frames long (1 = yes)
+int shard_possible(long* zc_array, long zc_count, long min, long max);
+
 // change the state of shards
 void activate_shard(SHARD* curshard);
 void activate_all_shards(SHARD** shardarray, int layers);
@@ -28,19 +89,228 @@ void deactivate_shard(SHARD* curshard);
 void deactivate_all_shards(SHARD** shardarray, int layers);
 
 // get the value from the layer
-float layer_tick(LAYER* layer, float* inframe);
+float layer_tick(LAYER* layer, SOURCE* source);
 
 // get the value from the layer/shard
-float shard_tick(LAYER* layer, SHARD* shard, float* inframe, int* change_check, double bias);
+float shard_tick(LAYER* layer, SHARD* shard, SOURCE* source, int* change_check, double bias);
 
 // see if the shard is going to change (0 = no change, 1 = change)
 int shift_check(SHARD* curshard, double bias);
 
+// find split points at onsets and in the energy valleys between them (returns the count)
+long find_onsets(SOURCE* source, long from, long to, double sensitivity, long** points);
+
+// the split-point scans that can run while the input is being loaded
+enum load_scan {SCAN_NONE,SCAN_ZERO,SCAN_NEAR_ZERO};
+
+// decode the input into source over a number of threads, scanning [from, to) for split points
+long load_source(const char* path, SOURCE* source, int threads, int scan, double near_zero,
+                 long from, long to, long** points);
+
 // gets data about a shard and prints it to the standard output
 void observe_shard(int layer_num, SHARD* curshard, int srate);
 
-// layer destruction function
-void destroy_layers(LAYER** thislayer, int layers);
+/************************ RENDER PLAN ************************************/
+
+typedef struct plan_shard
+{
+    long time;              // output frame where the shard takes over the layer
+    unsigned long entry;    // layer position at that frame (the old shard's start)
+    unsigned long start;    // the start point of the shard
+    unsigned long end;      // the end point of the shard
+    long loops;             // how many times the shard looped before it changed
+} PLAN_SHARD;
+
+typedef struct plan_layer
+{
+    long count;             // number of shards recorded for the layer
+    unsigned long step;     // playback step of the layer (see LAYER)
+    long capacity;          // allocated size of the shards array
+    long gainswitch;        // output frame where sqrfac replaces ampfac
+    long stop;              // output frame where the layer stops during the tail
+    PLAN_SHARD* shards;
+    float* sinc;            // interpolation table of the layer, only set while rendering
+} PLAN_LAYER;
+
+typedef struct render_plan
+{
+    int layers;             // number of layers in the plan
+    int srate;              // sample rate of the source
+    int outrate;            // sample rate of the output
+    unsigned long size;     // the number of frames in the source
+    long loopframes;        // frames rendered while the shards are looping
+    long totalframes;       // frames in the whole output, tail included
+    PLAN_LAYER* layer;
+} PLAN;
+
+// record every shard decision for a render without touching any audio
+PLAN* plan_shatter(long* zc_array, long zc_count, long min, long max, double bias, int layers,
+                   RNG* rngs, unsigned long* steps, unsigned long filesize, int srate, int outrate,
+                   long totalsamples, int tail, int nframes, int list_shards);
+
+// add frames [from, from + count) of one layer of a plan into out
+void plan_render_layer(PLAN* plan, int j, SOURCE* source, float* out, long from, long count);
+
+// render frames [from, from + count) of a plan into out
+void plan_render(PLAN* plan, SOURCE* source, float* out, long from, long count);
+
+// render frames [from, from + count) of a plan with its layers spread over a number of channels
+// (each channel's frames start stride floats after the last one's)
+void plan_render_channels(PLAN* plan, SOURCE* source, float* out, long from, long count, int channels, long stride);
+
+typedef struct render_pool RENDER_POOL;
+
+// a slice of the output handed to one render thread
+typedef struct plan_job
+{
+    RENDER_POOL* pool;
+    PLAN* plan;
+    SOURCE* source;
+    float* out;
+    long from;
+    long count;
+    int layer;              // the one layer to render, or -1 for all of them
+    int channels;           // channels the layers are spread over
+    long stride;            // floats from one channel's frames to the next
+    _Alignas(ARENA_ALIGN) long generation;     // last pass this thread rendered (on a line of its own)
+    pthread_t thread;
+} PLAN_JOB;
+
+// render threads started once and handed a slice of every pass
+struct render_pool
+{
+    int threads;            // slices each pass is split into (the last one is the caller's)
+    int running;            // worker threads actually started
+    PLAN_JOB* jobs;
+    pthread_mutex_t lock;
+    pthread_cond_t go;      // signals the workers that a pass is ready
+    pthread_cond_t done;    // signals the caller that every slice is rendered
+    long generation;        // counts the passes handed to the workers
+    int pending;            // workers still rendering the current pass
+    int quit;               // tells the workers to finish
+};
+
+// bytes a render pool for a number of threads takes up in an arena
+size_t render_pool_footprint(int threads);
+
+// lay out a render pool in an arena and start its threads (NULL on failure)
+RENDER_POOL* new_render_pool(ARENA* arena, int threads);
+
+// render frames [from, from + count) of a plan over channels as above, split over the pool's threads
+// (stride is count, and a NULL pool renders on this thread)
+void plan_render_parallel(RENDER_POOL* pool, PLAN* plan, SOURCE* source, float* out, long from, long count, int channels);
+
+// render frames [from, from + count) of layer j of a plan on its own into out, split over the pool's threads
+void plan_render_layer_parallel(RENDER_POOL* pool, PLAN* plan, int j, SOURCE* source, float* out, long from, long count);
+
+// stop the pool's threads (the pool itself goes with its arena)
+void destroy_render_pool(RENDER_POOL* pool);
+
+// write the plan to a file (returns 0 on success)
+int plan_save(PLAN* plan, const char* path);
+
+// read a plan back from a file (NULL on failure)
+PLAN* plan_load(const char* path);
+
+// plan destruction function
+void destroy_plan(PLAN* plan);
+
+/************************ CHECKPOINTS ************************************/
+
+// how far a render from a plan has got, saved next to the output
+/*  The plan already holds every random decision, so the frames written
+    so far are all that is needed to carry on, and the rest is there to
+    check that the plan, input and output still belong together. */
+typedef struct checkpoint
+{
+    long frames;            // output frames safely written
+    long totalframes;       // frames in the whole output (from the plan)
+    unsigned long size;     // the number of frames in the source
+    int srate;              // sample rate of the source
+    int outrate;            // sample rate of the output
+    int layers;
+    int format;             // libsndfile format of the output
+    int mapped;             // 1 if the output is written through a mapping (-d)
+    long offset;            // bytes before the first frame of a mapped output
+} CHECKPOINT;
+
+// write a checkpoint, replacing the old one only once the new one is complete (returns 0 on success)
+int checkpoint_save(CHECKPOINT* ckpt, const char* path);
+
+// read a checkpoint back (returns 0 on success)
+int checkpoint_load(CHECKPOINT* ckpt, const char* path);
+
+// remove a checkpoint, along with anything left of one being written
+void checkpoint_remove(const char* path);
+
+/************************ STEM CACHE ************************************/
+
+// each layer's part of the output, kept in a cache directory between runs
+/*  A stem is named after a hash of everything that goes into rendering its
+    layer, so a re-run only renders the layers that have changed and sums
+    the rest from the cache. */
+typedef struct stem_cache
+{
+    int layers;
+    long* length;           // frames of each stem (the layer is silent after that)
+    long* done;             // frames of each new stem written so far
+    int* fresh;             // 1 for stems being rendered now, 0 for ones from the cache
+    FILE** files;
+    char** paths;           // where each stem is kept
+    char** temps;           // where new stems are written until they are whole
+    float* scratch;         // one stretch of a stem
+    long size;              // frames the scratch buffer holds
+    int cached;             // number of stems taken from the cache
+} STEM_CACHE;
+
+// hash the audio of the source, the same whether it is kept as floats or 16-bit
+unsigned long long source_hash(SOURCE* source);
+
+// find each layer's stem in the cache, or get ready to render it there (NULL on failure)
+STEM_CACHE* open_stems(PLAN* plan, unsigned long long hash, const char* dir, long size);
+
+// render frames [from, from + count) by summing the stems, new ones over the pool's threads (returns 0 on success)
+int stem_render(STEM_CACHE* stems, RENDER_POOL* pool, PLAN* plan, SOURCE* source, float* out, long from, long count);
+
+// close the stems, keeping the new ones in the cache if they were rendered all the way through
+int close_stems(STEM_CACHE* stems, int keep);
+
+/************************ WEAVE CHAIN ************************************/
+
+#define CHAIN_BLOCKS (8)        // blocks that can wait between shatter and weave
+
+// hands shatter's output blocks to a weave running on its own thread
+typedef struct chain
+{
+    WEAVE* weave;
+    int size;               // frames in each block
+    float* blocks;          // CHAIN_BLOCKS blocks waiting to be woven
+    long counts[CHAIN_BLOCKS];
+    int first;              // oldest block that is waiting
+    int filled;             // number of blocks waiting
+    int finished;           // set once shatter has handed over every block
+    float* wet;             // weave output when it can't go straight into the file
+
+    SNDFILE* outfile;       // where the woven blocks go (either one or the other)
+    MAPOUT* mapout;
+    long written;           // frames written so far
+    int error;
+
+    int running;            // set while the weave thread is alive
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;   // a block is waiting
+    pthread_cond_t space;   // a block has been freed
+} CHAIN;
+
+// start a weave with the default patch, writing to outfile or mapout (NULL on failure)
+CHAIN* new_chain(int srate, int size, SNDFILE* outfile, MAPOUT* mapout);
+
+// hand count frames to the weave (returns count, or 0 after an error)
+long chain_write(CHAIN* chain, float* frames, long count);
+
+// wait for the weave to catch up and stop it (returns 0 on success)
+int finish_chain(CHAIN* chain);
 
-// shard destruction function
-void destroy_shards(SHARD** thisshard, int layers);
\ No newline at end of file
+// chain destruction function
+void destroy_chain(CHAIN* chain);
@@ -7,12 +7,107 @@
 #include <stdlib.h>
 #include <sndfile.h>
 #include <math.h>
+#include <limits.h>
+#include <sched.h>
 #include "weave_dat.h"
+#include "mapout.h"
 
-#define NFRAMES (1024)      // defines the size of the read/write buffer
+#define NFRAMES (1024)      // defines the size of the read/write buffer (a power of two for convolution)
+#define IRTHRESHOLD (-100.0)// default level (dB) below which the impulse response is cut off
+#define IRMAXSECS (60.0)    // longest impulse response the convolution engine will take
+#define NOISEFLOOR (-96.0)  // default level (dB) the network counts as silent below
 
 enum arg_list {ARG_PROGNAME,ARG_INFILE,ARG_OUTFILE,ARG_NARGS};
 
+// parameter automation read from a file by a control thread
+typedef struct automation
+{
+    FILE* fp;
+    WEAVE* weave;
+    int srate;
+    _Alignas(ARENA_ALIGN) atomic_long sent;    // every change before this frame is in the queue
+    _Alignas(ARENA_ALIGN) atomic_int quit;     // set when the audio loop stops listening
+    pthread_t thread;
+} AUTOMATION;
+
+// the largest magnitude in a block
+static float peak_level(float* frames, long count)
+{
+    float peak = 0.0;
+    for(long i = 0; i < count; i++){
+        float level = fabsf(frames[i]);
+        if(level > peak) peak = level;
+    }
+    return peak;
+}
+
+// read one line of an automation file ("seconds parameter value"), 0 = a change, 1 = nothing, -1 = malformed
+static int automation_line(const char* line, int srate, long last, long* frame, int* param, double* value)
+{
+    char name[64];
+    double secs;
+
+    if(sscanf(line," %63s",name) != 1 || name[0] == '#')
+        return 1;       // blank line or comment
+    if(sscanf(line,"%lf %63s %lf",&secs,name,value) != 3 || (*param = weave_param_id(name)) < 0
+       || secs < 0.0 || (*frame = llround(secs * srate)) < last)
+        return -1;
+    return 0;
+}
+
+// check a whole automation file before anything is rendered (returns the first bad line, 0 if none)
+/*  Besides malformed lines this turns away more changes inside one block
+    than the queue holds: the audio loop has to see all of a block's changes
+    queued before it runs the block, or the render would depend on timing. */
+static int automation_check(FILE* fp, int srate, long blockframes)
+{
+    char line[256];
+    long recent[PARAM_QUEUE_SIZE];  // frames of the last changes, oldest first
+    long frame, last = 0, count = 0;
+    double value;
+    int param, lineno = 0, bad = 0;
+
+    while(fgets(line,sizeof(line),fp)){
+        int kind = automation_line(line,srate,last,&frame,&param,&value);
+        lineno++;
+        if(kind > 0)
+            continue;
+        if(kind < 0 || (count >= PARAM_QUEUE_SIZE
+                        && frame - recent[count % PARAM_QUEUE_SIZE] < blockframes)){
+            bad = lineno;
+            break;
+        }
+        recent[count++ % PARAM_QUEUE_SIZE] = frame;
+        last = frame;
+    }
+    rewind(fp);
+    return bad;
+}
+
+// send each change in an automation file to the weave in turn
+static void* automate(void* arg)
+{
+    AUTOMATION* automation = (AUTOMATION*)arg;
+    char line[256];
+    double value;
+    long frame, last = 0;
+    int param;
+
+    while(fgets(line,sizeof(line),automation->fp)){
+        if(automation_line(line,automation->srate,last,&frame,&param,&value))
+            continue;       // automation_check has already turned away bad lines
+        atomic_store(&automation->sent,frame);
+        while(weave_send(automation->weave,param,value,frame)){
+            if(atomic_load(&automation->quit))
+                return NULL;
+            sched_yield();  // the queue is full until the audio loop catches up
+        }
+        last = frame;
+    }
+    atomic_store(&automation->sent,LONG_MAX);
+    return NULL;
+}
+
 int main(int argc, char** argv)
 {
     int error = 0;
@@ -20,18 +115,53 @@ int main(int argc, char** argv)
     // variables that handle the files
     SNDFILE* infile = NULL;
     SNDFILE* outfile = NULL;
+    MAPOUT* mapout = NULL;          // the output when it is rendered straight into a mapping
+    int mapped = 0;                 // flag to write the output through a memory mapping
     SF_INFO info;
     unsigned long filesize;
     double length_secs;
 
     // variables that handle the read/write buffers
+    ARENA* buffers = NULL;          // the input, output and wet blocks all live in here
     float* inframe = NULL;
     float* outframe = NULL;
+    float* outblock = NULL;         // where the current block is rendered to
     float curframe;
     int nframes = NFRAMES;
     long framesread = 0;
     long frameswrite = 0;
 
+    // the effects (set up once the input is open)
+    BLOCK* delay = NULL;
+    WEAVE* weave = NULL;
+
+    // variables that handle the processing engine
+    enum {ENGINE_AUTO,ENGINE_RECURSIVE,ENGINE_CONVOLUTION} engine = ENGINE_AUTO;
+    double ir_threshold = IRTHRESHOLD;
+    int threads = 1;
+    float* ir = NULL;
+    long irlength = 0;
+    float* wetframe = NULL;
+    CONVOLVER* conv = NULL;
+
+    // variables that handle the damping in the feedback paths
+    double damping = 0.0;           // one-pole lowpass cutoff (Hz)
+    double lowpass = 0.0;           // biquad lowpass cutoff (Hz)
+    int stages = 1;                 // biquads in the lowpass cascade
+
+    // variables that handle silence and the tail
+    double noise_floor = NOISEFLOOR;
+    int tail = 0;                   // flag to keep rendering after the input runs out
+    int gate = 0;                   // flag to skip blocks where everything is below the floor
+    long tailframes = 0;
+    long silentblocks = 0;          // consecutive input blocks below the floor (convolution)
+
+    // variables that handle automation
+    char* automation_file = NULL;   // file of timed parameter changes
+    AUTOMATION automation = {0};
+    int badline = 0;                // first line automation_check turned away
+    int automating = 0;             // set while the control thread is running
+
     printf("WEAVE (prototype-version): delay network with feedback\n");
 
     // handle options
@@ -43,6 +173,73 @@ int main(int argc, char** argv)
 			case('\0'):
 				printf("Error: missing flag name\n");
 				return 1;
+            case('c'):
+                engine = ENGINE_CONVOLUTION;
+                break;
+            case('r'):
+                engine = ENGINE_RECURSIVE;
+                break;
+            case('i'):
+                ir_threshold = atof(&(argv[1][2]));
+                if(ir_threshold >= 0.0){
+                    printf("Impulse response threshold must be below 0 dB.\n");
+                    return 1;
+                }
+                break;
+            case('j'):
+                threads = atoi(&(argv[1][2]));
+                if(threads < 1){
+                    printf("Number of threads cannot be < 1.\n");
+                    return 1;
+                }
+                break;
+            case('l'):
+                damping = atof(&(argv[1][2]));
+                if(damping < 0.0){
+                    printf("Damping cutoff cannot be < 0 Hz.\n");
+                    return 1;
+                }
+                break;
+            case('f'):
+                lowpass = atof(&(argv[1][2]));
+                if(lowpass < 0.0){
+                    printf("Lowpass cutoff cannot be < 0 Hz.\n");
+                    return 1;
+                }
+                break;
+            case('n'):
+                noise_floor = atof(&(argv[1][2]));
+                if(noise_floor >= 0.0){
+                    printf("Noise floor must be below 0 dB.\n");
+                    return 1;
+                }
+                break;
+            case('t'):
+                tail = 1;
+                break;
+            case('g'):
+                gate = 1;
+                break;
+            case('d'):
+                mapped = 1;
+                break;
+            case('a'):
+                automation_file = &(argv[1][2]);
+                if(*automation_file == '\0'){
+                    printf("Missing automation file name.\n");
+                    return 1;
+                }
+                break;
+            case('h'):
+                arena_huge_pages(1);
+                break;
+            case('s'):
+                stages = atoi(&(argv[1][2]));
+                if(stages < 1 || stages > DAMPING_STAGES){
+                    printf("Lowpass stages must be between 1 and %d.\n",DAMPING_STAGES);
+                    return 1;
+                }
+                break;
 			default:
 				break;
 			}
@@ -54,7 +251,34 @@ int main(int argc, char** argv)
     // usage message
     if(argc != ARG_NARGS){
         printf( "Insufficent arguments.\n"
-                "usage: weave infile outfile\n" // nothing so far
+                "usage: weave [-options] infile outfile\n"
+                "options:\t-c :\tAlways render with the convolution engine, using\n"
+                "\t\t\tthe impulse response of the patch\n"
+                "\t\t-r :\tAlways render with the recursive delay network\n"
+                "\t\t\t(default picks whichever is estimated to be faster)\n"
+                "\t\t-i :\tLevel (in dB) the cut off end of the impulse response\n"
+                "\t\t\tadds up to at most (default: -100) (ex. -i-80)\n"
+                "\t\t-j :\tNumber of threads sharing the convolution\n"
+                "\t\t\t(default: 1) (ex. -j4)\n"
+                "\t\t-l :\tDamps the feedback with a gentle lowpass at this\n"
+                "\t\t\tcutoff (in Hz) (ex. -l4000)\n"
+                "\t\t-f :\tFilters the feedback with a steeper lowpass at this\n"
+                "\t\t\tcutoff (in Hz) (ex. -f6000)\n"
+                "\t\t-s :\tNumber of stages in the -f lowpass, each adding\n"
+                "\t\t\t12 dB/octave (default: 1, max: 4) (ex. -s2)\n"
+                "\t\t-t :\tKeeps rendering after the input ends until the\n"
+                "\t\t\tdelays have died away below the noise floor\n"
+                "\t\t-g :\tSkips processing while the input and the delays\n"
+                "\t\t\tare all below the noise floor\n"
+                "\t\t-n :\tSets the noise floor (in dB) used by -t and -g\n"
+                "\t\t\t(default: -96) (ex. -n-80)\n"
+                "\t\t-a :\tChanges parameters while rendering, from a file of\n"
+                "\t\t\t\"seconds parameter value\" lines, where parameter is\n"
+                "\t\t\tgainA, gainB, AtoA, BtoA, AtoB or BtoB (ex. -aautomation.txt)\n"
+                "\t\t-d :\tRenders straight into a memory-mapped output file\n"
+                "\t\t\t(16-bit or float WAV/raw only)\n"
+                "\t\t-h :\tBacks the large buffers with huge pages where the\n"
+                "\t\t\tsystem has them\n"
                 );
         return 1;
     }
@@ -68,61 +292,189 @@ int main(int argc, char** argv)
         goto exit;
     }
 
-    // allocate memory for the I/O buffers
-    inframe = (float*)malloc(sizeof(float) * nframes * info.channels);
+    // allocate memory for the I/O buffers (the input, the output and the convolution's wet block)
+    buffers = new_arena(3 * arena_round(sizeof(float) * nframes * info.channels));
+    inframe = (float*)arena_alloc(buffers,sizeof(float) * nframes * info.channels);
     if(inframe == NULL){
         printf("Error allocating memory for input.\n");
         error++;
         goto exit;
     }
-    outframe = (float*)malloc(sizeof(float) * nframes * info.channels);
-    if(outframe == NULL){
-        printf("Error allocating memory for output.\n");
-        error++;
-        goto exit;
+    if(mapped){
+        // room for the input and the longest tail, trimmed to what was written at the end
+        long blocks = (info.frames * info.channels + nframes - 1) / nframes;
+        if(tail)
+            blocks += (long)(IRMAXSECS * info.samplerate + nframes - 1) / nframes + 1;
+        mapout = map_output(argv[ARG_OUTFILE],&info,blocks * nframes);
+        if(mapout == NULL){
+            printf("Error mapping output file: %s\n"
+                   "(only 16-bit or float WAV/raw files can be mapped)\n",argv[ARG_OUTFILE]);
+            error++;
+            goto exit;
+        }
+    }
+    if(mapout == NULL || mapout->pcm){
+        outframe = (float*)arena_alloc(buffers,sizeof(float) * nframes * info.channels);
+        if(outframe == NULL){
+            printf("Error allocating memory for output.\n");
+            error++;
+            goto exit;
+        }
     }
     // if that's all okay, create the output file
-    outfile = sf_open(argv[ARG_OUTFILE],SFM_WRITE,&info);
-    if(outfile == NULL){
-        printf("Error creating file: %s\n",argv[ARG_OUTFILE]);
-        error++;
-        goto exit;
+    if(mapout == NULL){
+        outfile = sf_open(argv[ARG_OUTFILE],SFM_WRITE,&info);
+        if(outfile == NULL){
+            printf("Error creating file: %s\n",argv[ARG_OUTFILE]);
+            error++;
+            goto exit;
+        }
     }
 
     /*************** initialize effects here *****************/
 
-    BLOCK* delay = new_block(0.25, info.samplerate);
-    WEAVE* weave = new_weave(0.25, 0.4, info.samplerate);
+    delay = new_block(0.25, info.samplerate);
+    weave = new_weave(0.25, 0.4, info.samplerate);
+    if(delay == NULL || weave == NULL || weave->delayA == NULL || weave->delayB == NULL){
+        printf("Error allocating memory for the delay network.\n");
+        error++;
+        goto exit;
+    }
     weave_default(weave,info.samplerate);
+    if(damping > 0.0 || lowpass > 0.0){
+        for(int line = 0; line < WEAVE_LINES; line++)
+            weave_damping(weave,line,damping,lowpass,stages);
+    }
+    weave_floor(weave,pow(10.0,noise_floor / 20.0));
+
+    if(automation_file){
+        // a patch that changes over time has no single impulse response
+        if(engine == ENGINE_CONVOLUTION){
+            printf("Automation can't be used with the convolution engine.\n");
+            error++;
+            goto exit;
+        }
+        engine = ENGINE_RECURSIVE;
+        automation.fp = fopen(automation_file,"r");
+        if(automation.fp == NULL){
+            printf("Error opening automation file %s\n",automation_file);
+            error++;
+            goto exit;
+        }
+        if((badline = automation_check(automation.fp,info.samplerate,nframes))){
+            printf("Error in automation file %s at line %d\n",automation_file,badline);
+            error++;
+            goto exit;
+        }
+        automation.weave = weave;
+        automation.srate = info.samplerate;
+        atomic_init(&automation.sent,0);
+        atomic_init(&automation.quit,0);
+        if(pthread_create(&automation.thread,NULL,automate,&automation)){
+            printf("Error starting automation.\n");
+            error++;
+            goto exit;
+        }
+        automating = 1;
+    }
+
+    // with a fixed patch the network is linear, so it can be replaced by its impulse response
+    if(engine == ENGINE_AUTO && info.frames <= IRMAXSECS * info.samplerate)
+        engine = ENGINE_RECURSIVE;      // too short to win back deriving the response
+    if(engine != ENGINE_RECURSIVE){
+        ir = weave_impulse(weave,pow(10.0,ir_threshold / 20.0),IRMAXSECS * info.samplerate,&irlength);
+        if(ir == NULL){
+            printf("Error deriving the impulse response.\n");
+            error++;
+            goto exit;
+        }
+        if(engine == ENGINE_AUTO)
+            engine = convolution_is_faster(irlength,info.frames,nframes,threads) ? ENGINE_CONVOLUTION : ENGINE_RECURSIVE;
+    }
+    if(engine == ENGINE_CONVOLUTION){
+        conv = new_convolver(ir,irlength,nframes,threads);
+        wetframe = (float*)arena_alloc(buffers,sizeof(float) * nframes);
+        if(conv == NULL || wetframe == NULL){
+            printf("Error creating the convolution engine.\n");
+            error++;
+            goto exit;
+        }
+        printf("Convolving with a %.2f second impulse response...\n",(double)irlength / info.samplerate);
+    }
 
     /**************** processing loop that writes to the output ********************/
 
-    while ((framesread = sf_read_float(infile,inframe,nframes)) > 0){
-	
-		for(long i = 0; i < framesread;i++){
+    // decaying feedback ends up in denormals, which are very slow to work with
+    denormals_off();
+
+    for(;;){
+        framesread = sf_read_float(infile,inframe,nframes);
+        if(framesread <= 0){
+            // out of input, keep feeding silence while the network still rings
+            if(!tail || tailframes >= IRMAXSECS * info.samplerate)
+                break;
+            if(conv ? tailframes >= irlength : weave_quiet(weave))
+                break;
+            for(long i = 0; i < nframes; i++)
+                inframe[i] = 0.0;
+            framesread = nframes;
+            tailframes += nframes;
+        }
+
+        if(automating){
+            // a file render waits for every change due in the block so runs come out the same
+            // (no block has more changes than the queue holds, so a full queue has all of them)
+            while(atomic_load(&automation.sent) < frameswrite + framesread
+                  && atomic_load(&weave->queue.head) - atomic_load(&weave->queue.tail) < PARAM_QUEUE_SIZE)
+                sched_yield();
+        }
+
+        // float outputs are rendered in place in the mapping
+        outblock = mapout ? map_frames(mapout,frameswrite) : NULL;
+        if(outblock == NULL)
+            outblock = outframe;
+
+        if(conv){
+            // the convolver always takes whole blocks
+            for(long i = framesread; i < nframes; i++)
+                inframe[i] = 0.0;
+            if(tail)
+                framesread = nframes;   // the padding is the start of the tail
+            silentblocks = (peak_level(inframe,nframes) > weave->floor) ? 0 : silentblocks + 1;
+            if(gate && silentblocks > conv->parts){
+                // every block the response still reaches is silent as well
+                for(long i = 0; i < nframes; i++)
+                    wetframe[i] = 0.0;
+            } else {
+                convolve_block(conv,inframe,wetframe);
+            }
+            for(long i = 0; i < framesread; i++)
+                outblock[i] = (inframe[i] * 0.5) + (wetframe[i] * 0.5);
+        } else if(gate && weave_gate(weave,inframe,framesread)){
+            for(long i = 0; i < framesread; i++)
+                outblock[i] = inframe[i] * 0.5;
+        } else {
             // this is where all the processing actually happens
-            //
-            //
-            float input = inframe[i];
-            float dry = input * 0.5;
-            // float wet = delay_tick(delay,input,0.45) * 0.5;
-            float wet = weave_tick(weave, input) * 0.5;
-
-            outframe[i] = dry + wet;
-            //
-            //
-            //
-        }
-		if(sf_write_float(outfile,outframe,framesread) != framesread){
+            weave_process(weave,inframe,outblock,framesread);
+        }
+        if(mapout ? map_write(mapout,outblock,frameswrite,framesread) != framesread
+                  : sf_write_float(outfile,outframe,framesread) != framesread){
 			printf("Error writing to outfile\n");
 			error++;
-			break;
+			goto exit;
 		}			
+        frameswrite += framesread;
 	}
 
     printf("Done.\nOutput saved to %s\n",argv[ARG_OUTFILE]);
 
 exit:
+    if(automating){
+        // nothing reads the queue any more, so let the control thread give up
+        atomic_store(&automation.quit,1);
+        pthread_join(automation.thread,NULL);
+    }
+    if(automation.fp) fclose(automation.fp);
     if(error){
         printf("%d error(s)\n",error);
     }
@@ -131,15 +483,21 @@ exit:
             printf("Error closing output file.\n");
         }
     }
+    if(mapout){
+        if(unmap_output(mapout,frameswrite)){
+            printf("Error closing output file.\n");
+        }
+    }
     if(infile){
         if(sf_close(infile)){
             printf("Error closing %s\n",argv[ARG_INFILE]);
         }
     }
-    if(inframe)  free(inframe);
-    if(outframe) free(outframe);
     destroy_block(delay);
     unravel(weave);
+    if(ir) free(ir);
+    destroy_convolver(conv);
+    destroy_arena(buffers);
 
     return 0;
 }
\ No newline at end of file
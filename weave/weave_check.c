@@ -0,0 +1,93 @@
+/* weave_check.c - checks that the convolution engine renders what the recursive network does */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "weave_dat.h"
+
+#define SRATE (44100)
+#define BLOCK (1024)
+#define SECS (20)          // long enough to reach past where the tail could be cut
+#define THRESHOLD (1e-5)    // -100 dB, the default impulse response threshold
+
+// one patch to check: the feedback damping and the threads sharing the convolution
+typedef struct check_case
+{
+    double damping;
+    double lowpass;
+    int stages;
+    int threads;
+} CHECK_CASE;
+
+static const CHECK_CASE cases[] = {
+    {0.0, 0.0, 1, 1},
+    {3000.0, 5000.0, 2, 1},
+    {3000.0, 5000.0, 2, 3},
+    {0.0, 2000.0, 4, 2},
+    {1500.0, 8000.0, DAMPING_STAGES, 4},
+};
+
+// render a burst of noise through both engines and return the largest difference (-1 on failure)
+static double check(const CHECK_CASE* c)
+{
+    long frames = (long)SECS * SRATE;
+    float* input = (float*)calloc(frames, sizeof(float));
+    float* wet = (float*)malloc(sizeof(float) * BLOCK);
+    WEAVE* weave = new_weave(0.25, 0.4, SRATE);
+    CONVOLVER* conv = NULL;
+    float* ir = NULL;
+    long irlength = 0;
+    double worst = -1.0;
+
+    if(input == NULL || wet == NULL || weave == NULL)
+        goto done;
+    weave_default(weave, SRATE);
+    if(c->damping > 0.0 || c->lowpass > 0.0){
+        for(int line = 0; line < WEAVE_LINES; line++)
+            weave_damping(weave, line, c->damping, c->lowpass, c->stages);
+    }
+    srand(1);
+    for(long i = 0; i < SRATE / 2; i++)
+        input[i] = 2.0 * rand() / RAND_MAX - 1.0;
+
+    ir = weave_impulse(weave, THRESHOLD, 60L * SRATE, &irlength);
+    conv = ir ? new_convolver(ir, irlength, BLOCK, c->threads) : NULL;
+    if(conv == NULL)
+        goto done;
+
+    worst = 0.0;
+    for(long pos = 0; pos + BLOCK <= frames; pos += BLOCK){
+        weave_update(weave, BLOCK);
+        convolve_block(conv, input + pos, wet);
+        for(long i = 0; i < BLOCK; i++){
+            double diff = fabs(weave_tick(weave, input[pos + i]) - wet[i]);
+            if(diff > worst) worst = diff;
+        }
+    }
+
+done:
+    destroy_convolver(conv);
+    unravel(weave);
+    if(ir) free(ir);
+    if(input) free(input);
+    if(wet) free(wet);
+    return worst;
+}
+
+int main(void)
+{
+    int failed = 0;
+
+    denormals_off();
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++){
+        const CHECK_CASE* c = &cases[i];
+        double worst = check(c);
+        // the cut off tail adds up to at most the threshold, and the input is at most full scale
+        int ok = (worst >= 0.0 && worst <= THRESHOLD);
+        printf("%s: damping %g Hz, lowpass %g Hz x%d, %d thread(s): largest difference %g\n",
+               ok ? "ok  " : "FAIL", c->damping, c->lowpass, c->stages, c->threads, worst);
+        if(!ok) failed++;
+    }
+    if(failed)
+        printf("%d of %d check(s) failed\n", failed, (int)(sizeof(cases) / sizeof(cases[0])));
+    return failed != 0;
+}
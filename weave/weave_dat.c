@@ -1,39 +1,82 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
 #include "weave_dat.h"
 
 /************************ DELAY BLOCK FUNCTIONS ************************************/
 
-// allocate a new delay block
-BLOCK* new_block(float seconds, int srate)
+#define DEFAULT_DELAY_A (0.45)      // delay times of the default patch (see weave_default)
+#define DEFAULT_DELAY_B (0.15)
+
+// delay time in samples
+static unsigned long block_frames(float seconds, int srate)
+{
+    return (unsigned long)(seconds * srate);
+}
+
+// bytes a delay block with room for capacity samples takes up in an arena
+static size_t block_footprint(unsigned long capacity)
+{
+    return arena_round(sizeof(BLOCK)) + arena_round(sizeof(float) * capacity);
+}
+
+// set the delay time (up to the block's capacity) and clear the block
+static void block_reset(BLOCK* block, unsigned long dtime)
+{
+    block->dtime = (dtime < block->capacity) ? dtime : block->capacity;
+    memset(block->buffer, 0, sizeof(float) * block->capacity);
+    block->writepos = 0;
+
+    block->input = 0.0;
+    block->output = 0.0;
+
+    block->floor = 0.0;
+    block->quiet = block->dtime;    // an empty block is silent
+}
+
+// lay out a delay block in an arena
+static BLOCK* block_place(ARENA* arena, unsigned long dtime, unsigned long capacity, int srate)
 {
-    BLOCK* block = (BLOCK*)malloc(sizeof(BLOCK));
+    BLOCK* block = (BLOCK*)arena_alloc(arena, sizeof(BLOCK));
     if(block == NULL)
         return NULL;
-    block->dtime = (unsigned long)(seconds * srate);
-    block->buffer = (float*)malloc(sizeof(float) * block->dtime);
+    block->buffer = (float*)arena_alloc(arena, sizeof(float) * capacity);
     if(block->buffer == NULL)
         return NULL;
     block->srate = srate;
-    block->writepos = 0;
+    block->capacity = capacity;
+    block->arena = NULL;
+    block_reset(block, dtime);
 
-    block->input = 0.0;
-    block->output = 0.0;
+    return block;
+}
+
+// allocate a new delay block
+BLOCK* new_block(float seconds, int srate)
+{
+    unsigned long dtime = block_frames(seconds, srate);
+    ARENA* arena = new_arena(block_footprint(dtime));
+    BLOCK* block = block_place(arena, dtime, dtime, srate);
 
+    if(block == NULL){
+        destroy_arena(arena);
+        return NULL;
+    }
+    block->arena = arena;       // the block owns this arena, so it goes with the block
     return block;
 }
 
 // destroy a delay block
 void destroy_block(BLOCK* block)
 {
-    if(block){
-        if(block->buffer)
-            free(block->buffer);
-            block->buffer = NULL;
-        free(block);
-        block = NULL;
-    }
-    
+    // blocks that are part of a weave go with the weave's arena
+    if(block)
+        destroy_arena(block->arena);
 }
 
 // the main delay processor
@@ -58,14 +101,156 @@ float delay_tick(BLOCK* block, float input, double fblevel)
 
 }
 
+/***************************** DAMPING FUNCTIONS *************************************/
+
+#define DAMPING_GLIDE (0.02)    // time (in seconds) coefficients take to settle on a new setting
+
+// set the damping filters to let everything through
+static void damping_init(DAMPING* damping, int srate)
+{
+    memset(damping, 0, sizeof(DAMPING));
+    damping->srate = srate;
+    for(int l = 0; l < WEAVE_LINES; l++){
+        damping->pole[l] = damping->poletarget[l] = 1.0;
+        for(int s = 0; s < DAMPING_STAGES; s++)
+            damping->coef[BQ_B0][s][l] = damping->target[BQ_B0][s][l] = 1.0;
+    }
+}
+
+// clear what the filters remember, keeping their settings
+static void damping_clear(DAMPING* damping)
+{
+    memset(damping->polestate, 0, sizeof(damping->polestate));
+    memset(damping->z1, 0, sizeof(damping->z1));
+    memset(damping->z2, 0, sizeof(damping->z2));
+}
+
+// run one frame of every delay line through its filters
+static void damping_process(DAMPING* damping, float* x)
+{
+    for(int l = 0; l < WEAVE_LINES; l++){
+        damping->polestate[l] += damping->pole[l] * (x[l] - damping->polestate[l]);
+        x[l] = damping->polestate[l];
+    }
+    for(int s = 0; s < damping->stages; s++){
+        float* b0 = damping->coef[BQ_B0][s];
+        float* b1 = damping->coef[BQ_B1][s];
+        float* b2 = damping->coef[BQ_B2][s];
+        float* a1 = damping->coef[BQ_A1][s];
+        float* a2 = damping->coef[BQ_A2][s];
+        float* z1 = damping->z1[s];
+        float* z2 = damping->z2[s];
+        for(int l = 0; l < WEAVE_LINES; l++){
+            float in = x[l];
+            float out = b0[l] * in + z1[l];
+            z1[l] = b1[l] * in - a1[l] * out + z2[l];
+            z2[l] = b2[l] * in - a2[l] * out;
+            x[l] = out;
+        }
+    }
+}
+
+// check that nothing above level is left in the filters' memory (1 = quiet)
+static int damping_quiet(DAMPING* damping, double level)
+{
+    if(!damping->active)
+        return 1;
+    for(int l = 0; l < WEAVE_LINES; l++){
+        if(fabsf(damping->polestate[l]) > level)
+            return 0;
+        for(int s = 0; s < damping->stages; s++){
+            if(fabsf(damping->z1[s][l]) > level || fabsf(damping->z2[s][l]) > level)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+// move the coefficients a block's worth towards their targets
+static void damping_glide(DAMPING* damping, long frames)
+{
+    float amount = 1.0 - exp(-(double)frames / (DAMPING_GLIDE * damping->srate));
+    float* coef = &damping->coef[0][0][0];
+    float* target = &damping->target[0][0][0];
+
+    for(int l = 0; l < WEAVE_LINES; l++)
+        damping->pole[l] += amount * (damping->poletarget[l] - damping->pole[l]);
+    for(int i = 0; i < BQ_NCOEFS * DAMPING_STAGES * WEAVE_LINES; i++)
+        coef[i] += amount * (target[i] - coef[i]);
+}
+
+// set the damping of a delay line's feedback (cutoffs in Hz, 0 = off)
+/*  cutoff sets a gentle one-pole lowpass, lowpass a cascade of stages
+    Butterworth-style biquads for a steeper slope. */
+void weave_damping(WEAVE* weave, int line, double cutoff, double lowpass, int stages)
+{
+    DAMPING* damping = &weave->damping;
+    double nyquist = damping->srate * 0.5;
+
+    if(line < 0 || line >= WEAVE_LINES)
+        return;
+    if(stages > DAMPING_STAGES) stages = DAMPING_STAGES;
+    if(lowpass <= 0.0 || lowpass >= nyquist) stages = 0;
+
+    if(cutoff > 0.0 && cutoff < nyquist)
+        damping->poletarget[line] = 1.0 - exp(-2.0 * M_PI * cutoff / damping->srate);
+    else
+        damping->poletarget[line] = 1.0;
+
+    for(int s = 0; s < DAMPING_STAGES; s++){
+        double b0 = 1.0, b1 = 0.0, b2 = 0.0, a1 = 0.0, a2 = 0.0;
+        if(s < stages){
+            double w = 2.0 * M_PI * lowpass / damping->srate;
+            double alpha = sin(w) / (2.0 * M_SQRT1_2);
+            double a0 = 1.0 + alpha;
+            b1 = (1.0 - cos(w)) / a0;
+            b0 = b2 = b1 * 0.5;
+            a1 = (-2.0 * cos(w)) / a0;
+            a2 = (1.0 - alpha) / a0;
+        }
+        damping->target[BQ_B0][s][line] = b0;
+        damping->target[BQ_B1][s][line] = b1;
+        damping->target[BQ_B2][s][line] = b2;
+        damping->target[BQ_A1][s][line] = a1;
+        damping->target[BQ_A2][s][line] = a2;
+    }
+    if(stages > damping->stages)
+        damping->stages = stages;
+    damping->active = 1;
+
+    // nothing is playing through the filters yet, so there is nothing to glide from
+    if(!damping->running){
+        memcpy(damping->pole, damping->poletarget, sizeof(damping->pole));
+        memcpy(damping->coef, damping->target, sizeof(damping->coef));
+    }
+}
+
 /***************************** WEAVE NETWORK FUNCTIONS *************************************/
 
 // allocate a new weave
+/*  The weave and both of its delay lines are laid out in one arena, each
+    line with room for the default patch as well, so weave_default never
+    has to allocate. */
 WEAVE* new_weave(double dtimeA, double dtimeB, int srate)
 {
-    // allocate the weave itself and initialize parameters
-    WEAVE* weave = (WEAVE*)malloc(sizeof(WEAVE));
+    unsigned long framesA = block_frames(dtimeA, srate);
+    unsigned long framesB = block_frames(dtimeB, srate);
+    unsigned long roomA = block_frames(DEFAULT_DELAY_A, srate);
+    unsigned long roomB = block_frames(DEFAULT_DELAY_B, srate);
+    ARENA* arena;
+    WEAVE* weave;
+
+    if(roomA < framesA) roomA = framesA;
+    if(roomB < framesB) roomB = framesB;
+    arena = new_arena(arena_round(sizeof(WEAVE)) + block_footprint(roomA) + block_footprint(roomB));
+    weave = (WEAVE*)arena_alloc(arena, sizeof(WEAVE));
+    if(weave == NULL){
+        destroy_arena(arena);
+        return NULL;
+    }
+    weave->arena = arena;
 
+    // initialize parameters
     weave->wetdrymix = 0.5;
     weave->inputgainA = 1.0;
     weave->inputgainB = 1.0;
@@ -79,15 +264,23 @@ WEAVE* new_weave(double dtimeA, double dtimeB, int srate)
     weave->feedbackfromBtoA =
     weave->feedbackfromBtoB = 0.0;
 
-    // now let's initialize the internal delay blocks
-    BLOCK* blockA = (BLOCK*)malloc(sizeof(BLOCK));
-    BLOCK* blockB = (BLOCK*)malloc(sizeof(BLOCK));
+    damping_init(&weave->damping, srate);
+    weave->floor = 0.0;
+    weave->silent = 0;
 
-    blockA = new_block(weave->delaytimeA,srate);
-    blockB = new_block(weave->delaytimeB,srate);
+    atomic_init(&weave->queue.head, 0);
+    atomic_init(&weave->queue.tail, 0);
+    weave->clock = 0;
+    weave->ramp = PARAM_RAMP * srate;
+    if(weave->ramp < 1)
+        weave->ramp = 1;
+    weave->gliding = 0;
+    for(int p = 0; p < WP_NPARAMS; p++)
+        weave->paramleft[p] = 0;
 
-    weave->delayA = blockA;
-    weave->delayB = blockB;
+    // now let's initialize the internal delay blocks
+    weave->delayA = block_place(arena, framesA, roomA, srate);
+    weave->delayB = block_place(arena, framesB, roomB, srate);
 
     return weave;
 
@@ -96,12 +289,8 @@ WEAVE* new_weave(double dtimeA, double dtimeB, int srate)
 // weave destructor
 void unravel(WEAVE* weave)
 {
-    if(weave){
-        destroy_block(weave->delayA);
-        destroy_block(weave->delayB);
-        free(weave);
-        weave = NULL;
-    }
+    if(weave)
+        destroy_arena(weave->arena);
 }
 
 // read the delay block signal
@@ -126,6 +315,99 @@ void block_write(BLOCK* block, float input)
     buf[block->writepos++] = input;
     if(block->writepos == block->dtime)
         block->writepos = 0;
+
+    if(fabsf(input) > block->floor)
+        block->quiet = 0;
+    else
+        block->quiet++;
+}
+
+/***************************** PARAMETER CHANGES *************************************/
+
+static const char* param_names[WP_NPARAMS] = {"gainA","gainB","AtoA","BtoA","AtoB","BtoB"};
+
+// where each parameter lives in the weave
+static const size_t param_offset[WP_NPARAMS] = {
+    offsetof(WEAVE,inputgainA),
+    offsetof(WEAVE,inputgainB),
+    offsetof(WEAVE,feedbackfromAtoA),
+    offsetof(WEAVE,feedbackfromBtoA),
+    offsetof(WEAVE,feedbackfromAtoB),
+    offsetof(WEAVE,feedbackfromBtoB)
+};
+
+#define PARAM_FIELD(weave,p) ((double*)((char*)(weave) + param_offset[p]))
+
+// look up a parameter by name
+int weave_param_id(const char* name)
+{
+    for(int p = 0; p < WP_NPARAMS; p++)
+        if(strcmp(name, param_names[p]) == 0)
+            return p;
+    return -1;
+}
+
+// send a parameter change from the control thread, for the block holding frame
+int weave_send(WEAVE* weave, int param, double value, long frame)
+{
+    PARAM_QUEUE* queue = &weave->queue;
+    unsigned long head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    if(head - atomic_load_explicit(&queue->tail, memory_order_acquire) == PARAM_QUEUE_SIZE)
+        return 1;
+    queue->changes[head & (PARAM_QUEUE_SIZE - 1)] = (PARAM_CHANGE){frame, param, value};
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return 0;
+}
+
+// take the changes due in the next block off the queue, either ramping to them or jumping
+static void weave_receive(WEAVE* weave, long frames, int snap)
+{
+    PARAM_QUEUE* queue = &weave->queue;
+    unsigned long tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    unsigned long head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    for(; tail != head; tail++){
+        PARAM_CHANGE* change = &queue->changes[tail & (PARAM_QUEUE_SIZE - 1)];
+        if(change->frame >= weave->clock + frames)
+            break;      // changes come in order, so the rest are later still
+        if(change->param < 0 || change->param >= WP_NPARAMS)
+            continue;
+        weave->paramtarget[change->param] = change->value;
+        weave->paramstep[change->param] = (change->value - *PARAM_FIELD(weave, change->param)) / weave->ramp;
+        weave->paramleft[change->param] = weave->ramp;
+        weave->gliding = 1;
+    }
+    atomic_store_explicit(&queue->tail, tail, memory_order_release);
+    weave->clock += frames;
+
+    if(snap && weave->gliding){
+        for(int p = 0; p < WP_NPARAMS; p++){
+            if(weave->paramleft[p]){
+                *PARAM_FIELD(weave, p) = weave->paramtarget[p];
+                weave->paramleft[p] = 0;
+            }
+        }
+        weave->gliding = 0;
+    }
+}
+
+// move every parameter that is changing one frame along its ramp
+static void weave_glide(WEAVE* weave)
+{
+    int moving = 0;
+
+    for(int p = 0; p < WP_NPARAMS; p++){
+        if(weave->paramleft[p]){
+            double* field = PARAM_FIELD(weave, p);
+            if(--weave->paramleft[p])
+                *field += weave->paramstep[p];
+            else
+                *field = weave->paramtarget[p];     // land on it exactly
+            moving = 1;
+        }
+    }
+    weave->gliding = moving;
 }
 
 // the main effect process
@@ -134,15 +416,25 @@ float weave_tick(WEAVE* weave, float input)
     float output;
     float outA, outB;
     float inA, inB;
+    float feedback[WEAVE_LINES];
+
+    if(weave->gliding)
+        weave_glide(weave);
 
     // get read position from delaytime
     outA = block_read(weave->delayA);
     outB = block_read(weave->delayB);
 
-    inA = (input * weave->inputgainA) + (outA * weave->feedbackfromAtoA)
-          + (outB * weave->feedbackfromBtoA);
-    inB = (input * weave->inputgainB) + (outA * weave->feedbackfromAtoB)
-          + (outB * weave->feedbackfromBtoB);
+    // darken what gets fed back, the output taps stay as they are
+    feedback[0] = outA;
+    feedback[1] = outB;
+    if(weave->damping.active)
+        damping_process(&weave->damping, feedback);
+
+    inA = (input * weave->inputgainA) + (feedback[0] * weave->feedbackfromAtoA)
+          + (feedback[1] * weave->feedbackfromBtoA);
+    inB = (input * weave->inputgainB) + (feedback[0] * weave->feedbackfromAtoB)
+          + (feedback[1] * weave->feedbackfromBtoB);
 
     // write the delayed signal
     block_write(weave->delayA,inA);
@@ -163,24 +455,443 @@ void weave_default(WEAVE* weave, int srate)
     weave->inputgainA = 1.0;
     weave->feedbackfromAtoA = 0.4;
     weave->feedbackfromBtoA = 0.3;
-    weave->delaytimeA = 0.45;
+    weave->delaytimeA = DEFAULT_DELAY_A;
 
     // parameters for delay block B
     weave->inputgainB = 0.3;
     weave->feedbackfromAtoB = 0.3;
     weave->feedbackfromBtoB = 0.6;
-    weave->delaytimeB = 0.15;
+    weave->delaytimeB = DEFAULT_DELAY_B;
+
+    // the lines were made with room for these times
+    block_reset(weave->delayA, block_frames(weave->delaytimeA, srate));
+    block_reset(weave->delayB, block_frames(weave->delaytimeB, srate));
+
+}
+
+// block-rate housekeeping, call before each block of frames
+void weave_update(WEAVE* weave, long frames)
+{
+    weave_receive(weave, frames, 0);
+    if(weave->damping.active)
+        damping_glide(&weave->damping, frames);
+    weave->damping.running = 1;
+}
+
+// set the level (linear) below which the network counts as silent
+void weave_floor(WEAVE* weave, double floor)
+{
+    weave->floor = floor;
+    weave->delayA->floor = floor;
+    weave->delayB->floor = floor;
+}
+
+// check if nothing above the noise floor is left in the network (1 = quiet)
+int weave_quiet(WEAVE* weave)
+{
+    return weave->delayA->quiet >= weave->delayA->dtime
+           && weave->delayB->quiet >= weave->delayB->dtime;
+}
+
+// check if a block can be skipped, clearing the network the first time (1 = skip)
+/*  Anything left below the floor would only decay towards denormals, so
+    the delay blocks and filters are emptied once and the network then sits
+    idle until something above the floor comes in. */
+int weave_gate(WEAVE* weave, float* input, long frames)
+{
+    if(!weave_quiet(weave) || weave->gliding){
+        weave->silent = 0;
+        return 0;
+    }
+    for(long i = 0; i < frames; i++){
+        if(fabsf(input[i]) > weave->floor){
+            weave->silent = 0;
+            return 0;
+        }
+    }
+    // nothing plays through the network, so changes can land straight away
+    weave_receive(weave, frames, 1);
+    if(!weave->silent){
+        memset(weave->delayA->buffer, 0, sizeof(float) * weave->delayA->dtime);
+        memset(weave->delayB->buffer, 0, sizeof(float) * weave->delayB->dtime);
+        damping_clear(&weave->damping);
+        weave->silent = 1;
+    }
+    return 1;
+}
+
+// run a block through the network, mixing it half and half with the dry input
+void weave_process(WEAVE* weave, float* input, float* output, long frames)
+{
+    weave_update(weave,frames);
+    for(long i = 0; i < frames; i++){
+        float dry = input[i] * 0.5;
+        float wet = weave_tick(weave, input[i]) * 0.5;
+        output[i] = dry + wet;
+    }
+}
+
+// flush denormals to zero on the calling thread
+void denormals_off(void)
+{
+#if defined(__SSE__)
+    _mm_setcsr(_mm_getcsr() | 0x8040);      // flush to zero and denormals are zero
+#elif defined(__aarch64__)
+    unsigned long fpcr;
+    __asm__ volatile("mrs %0, fpcr" : "=r"(fpcr));
+    __asm__ volatile("msr fpcr, %0" : : "r"(fpcr | (1UL << 24)));
+#endif
+}
+
+/************************ CONVOLUTION ENGINE ************************************/
+
+#define IR_TAIL_MARGIN (0.1)   // share of the threshold the unrendered tail may be estimated at
+
+// derive the impulse response of the weave's current patch, truncated below threshold
+/*  The impulse is run through a separate weave with the same patch, one
+    longest-delay window at a time. The tail dies away about geometrically
+    from one window to the next, so the run stops once what is left past the
+    current window works out well below the threshold and neither the delay
+    blocks nor the damping filters hold anything above it (or at maxlen if
+    the patch rings for longer than that). The response is then cut where
+    everything after the cut adds up to no more than the threshold, which
+    keeps convolving with it within threshold of the recursive network for
+    any input up to full scale. */
+float* weave_impulse(WEAVE* weave, double threshold, long maxlen, long* length)
+{
+    WEAVE* probe = new_weave(weave->delaytimeA, weave->delaytimeB, weave->delayA->srate);
+    float* ir = (float*)malloc(sizeof(float) * maxlen);
+    float* shrunk;
+    long last;
+    long window;
+    long frames = maxlen;
+    double windowsum = 0.0;     // sum of |ir| over the current window
+    double lastsum = 0.0;       // and over the one before it
+    double tail = 0.0;
+
+    if(probe == NULL || probe->delayA == NULL || probe->delayB == NULL || ir == NULL){
+        unravel(probe);
+        if(ir) free(ir);
+        return NULL;
+    }
+    probe->inputgainA = weave->inputgainA;
+    probe->inputgainB = weave->inputgainB;
+    probe->feedbackfromAtoA = weave->feedbackfromAtoA;
+    probe->feedbackfromBtoA = weave->feedbackfromBtoA;
+    probe->feedbackfromAtoB = weave->feedbackfromAtoB;
+    probe->feedbackfromBtoB = weave->feedbackfromBtoB;
+    probe->damping = weave->damping;
+    damping_clear(&probe->damping);
+    weave_floor(probe, threshold);
+    window = (probe->delayA->dtime > probe->delayB->dtime) ? probe->delayA->dtime : probe->delayB->dtime;
+
+    for(long i = 0; i < maxlen; i++){
+        ir[i] = weave_tick(probe, (i == 0) ? 1.0 : 0.0);
+        windowsum += fabs(ir[i]);
+        if((i + 1) % window == 0){
+            if(i + 1 > window && windowsum < lastsum){
+                double ratio = windowsum / lastsum;
+                if(windowsum * ratio / (1.0 - ratio) < threshold * IR_TAIL_MARGIN
+                   && weave_quiet(probe) && damping_quiet(&probe->damping, threshold)){
+                    frames = i + 1;
+                    break;
+                }
+            }
+            lastsum = windowsum;
+            windowsum = 0.0;
+        }
+    }
+    unravel(probe);
 
-    destroy_block(weave->delayA);
-    destroy_block(weave->delayB);
+    // cut off as much of the end as adds up to no more than the threshold
+    last = frames;
+    while(last > 1 && tail + fabs(ir[last - 1]) <= threshold)
+        tail += fabs(ir[--last]);
+    shrunk = (float*)realloc(ir, sizeof(float) * last);
+    if(shrunk) ir = shrunk;
+    *length = last;
 
-    BLOCK* blockA = (BLOCK*)malloc(sizeof(BLOCK));
-    BLOCK* blockB = (BLOCK*)malloc(sizeof(BLOCK));
+    return ir;
+}
 
-    blockA = new_block(weave->delaytimeA,srate);
-    blockB = new_block(weave->delaytimeB,srate);
+// in-place radix-2 transform of fftsize complex values (unscaled)
+static void conv_fft(CONVOLVER* conv, float* re, float* im, int inverse)
+{
+    int n = conv->fftsize;
+
+    for(int i = 0; i < n; i++){
+        int j = conv->reverse[i];
+        if(j > i){
+            float tmp = re[i]; re[i] = re[j]; re[j] = tmp;
+            tmp = im[i]; im[i] = im[j]; im[j] = tmp;
+        }
+    }
+    for(int len = 2; len <= n; len <<= 1){
+        int half = len >> 1;
+        int step = n / len;
+        for(int i = 0; i < n; i += len){
+            for(int k = 0; k < half; k++){
+                float wr = conv->twre[k * step];
+                float wi = inverse ? -conv->twim[k * step] : conv->twim[k * step];
+                int a = i + k;
+                int b = a + half;
+                float tr = re[b] * wr - im[b] * wi;
+                float ti = re[b] * wi + im[b] * wr;
+                re[b] = re[a] - tr;
+                im[b] = im[a] - ti;
+                re[a] += tr;
+                im[a] += ti;
+            }
+        }
+    }
+}
 
-    weave->delayA = blockA;
-    weave->delayB = blockB;
+// transform fftsize real values and keep the non-redundant bins
+static void conv_spectrum(CONVOLVER* conv, float* data, float* re, float* im)
+{
+    memcpy(conv->workre, data, sizeof(float) * conv->fftsize);
+    memset(conv->workim, 0, sizeof(float) * conv->fftsize);
+    conv_fft(conv, conv->workre, conv->workim, 0);
+    memcpy(re, conv->workre, sizeof(float) * conv->bins);
+    memcpy(im, conv->workim, sizeof(float) * conv->bins);
+}
 
+// multiply and sum one thread's slice of the partitions
+static void conv_accumulate(CONVOLVER* conv, int index)
+{
+    long share = (conv->parts + conv->threads - 1) / conv->threads;
+    long first = index * share;
+    long last = (first + share < conv->parts) ? first + share : conv->parts;
+    int bins = conv->bins;
+    float* accre = conv->accre + (long)index * conv->accstride;
+    float* accim = conv->accim + (long)index * conv->accstride;
+
+    memset(accre, 0, sizeof(float) * bins);
+    memset(accim, 0, sizeof(float) * bins);
+    for(long p = first; p < last; p++){
+        long slot = (conv->current - p + conv->parts) % conv->parts;
+        float* xr = conv->fdlre + slot * bins;
+        float* xi = conv->fdlim + slot * bins;
+        float* hr = conv->irre + p * bins;
+        float* hi = conv->irim + p * bins;
+        for(int k = 0; k < bins; k++){
+            accre[k] += xr[k] * hr[k] - xi[k] * hi[k];
+            accim[k] += xr[k] * hi[k] + xi[k] * hr[k];
+        }
+    }
+}
+
+// worker thread, sums its slice every time a block is handed out
+static void* conv_worker(void* arg)
+{
+    CONV_WORKER* worker = (CONV_WORKER*)arg;
+    CONVOLVER* conv = worker->conv;
+
+    denormals_off();
+    for(;;){
+        pthread_mutex_lock(&conv->lock);
+        while(conv->generation == worker->generation && !conv->quit)
+            pthread_cond_wait(&conv->go, &conv->lock);
+        if(conv->quit){
+            pthread_mutex_unlock(&conv->lock);
+            break;
+        }
+        worker->generation = conv->generation;
+        pthread_mutex_unlock(&conv->lock);
+
+        conv_accumulate(conv, worker->index);
+
+        pthread_mutex_lock(&conv->lock);
+        if(--conv->pending == 0)
+            pthread_cond_signal(&conv->done);
+        pthread_mutex_unlock(&conv->lock);
+    }
+    return NULL;
+}
+
+// allocate a convolver for an impulse response with a block size and thread count
+/*  size has to be a power of two. The impulse response is cut into
+    partitions of one block each and every partition is transformed once here;
+    each block of input then costs one forward and one inverse transform plus
+    a multiply-add per partition, which is what gets spread over the threads. */
+CONVOLVER* new_convolver(float* ir, long length, int size, int threads)
+{
+    long parts = (length + size - 1) / size;
+    int fftsize = size * 2;
+    int bins = size + 1;
+    long accstride = arena_round(sizeof(float) * bins) / sizeof(float);
+    size_t spectra = arena_round(sizeof(float) * parts * bins);
+    size_t frames = arena_round(sizeof(float) * fftsize);
+    ARENA* arena;
+    CONVOLVER* conv;
+    float* part;
+    int bits = 0;
+
+    while((1 << bits) < fftsize)
+        bits++;
+    if((1 << bits) != fftsize || parts < 1)
+        return NULL;
+    if(threads > parts) threads = parts;
+    if(threads < 1) threads = 1;
+
+    // everything goes in one arena, each thread's accumulators and worker on cache lines of their own
+    arena = new_arena(arena_round(sizeof(CONVOLVER)) + 4 * spectra
+                      + 2 * arena_round(sizeof(float) * threads * accstride) + 4 * frames
+                      + 2 * arena_round(sizeof(float) * size) + arena_round(sizeof(int) * fftsize)
+                      + arena_round(sizeof(CONV_WORKER) * threads));
+    conv = (CONVOLVER*)arena_alloc(arena, sizeof(CONVOLVER));
+    if(conv == NULL){
+        destroy_arena(arena);
+        return NULL;
+    }
+    conv->arena = arena;
+    conv->size = size;
+    conv->fftsize = fftsize;
+    conv->bins = bins;
+    conv->parts = parts;
+    conv->threads = threads;
+    conv->accstride = accstride;
+
+    conv->irre = (float*)arena_alloc(arena, sizeof(float) * parts * bins);
+    conv->irim = (float*)arena_alloc(arena, sizeof(float) * parts * bins);
+    conv->fdlre = (float*)arena_alloc(arena, sizeof(float) * parts * bins);
+    conv->fdlim = (float*)arena_alloc(arena, sizeof(float) * parts * bins);
+    conv->accre = (float*)arena_alloc(arena, sizeof(float) * threads * accstride);
+    conv->accim = (float*)arena_alloc(arena, sizeof(float) * threads * accstride);
+    conv->history = (float*)arena_alloc(arena, sizeof(float) * fftsize);
+    conv->workre = (float*)arena_alloc(arena, sizeof(float) * fftsize);
+    conv->workim = (float*)arena_alloc(arena, sizeof(float) * fftsize);
+    conv->twre = (float*)arena_alloc(arena, sizeof(float) * size);
+    conv->twim = (float*)arena_alloc(arena, sizeof(float) * size);
+    conv->reverse = (int*)arena_alloc(arena, sizeof(int) * fftsize);
+    conv->workers = (CONV_WORKER*)arena_alloc(arena, sizeof(CONV_WORKER) * threads);
+    part = (float*)arena_alloc(arena, sizeof(float) * fftsize);   // only needed here
+    if(part == NULL){
+        destroy_arena(arena);
+        return NULL;
+    }
+
+    for(int k = 0; k < size; k++){
+        conv->twre[k] = cos(2.0 * M_PI * k / conv->fftsize);
+        conv->twim[k] = -sin(2.0 * M_PI * k / conv->fftsize);
+    }
+    for(int i = 0; i < conv->fftsize; i++){
+        int r = 0;
+        for(int b = 0; b < bits; b++){
+            if(i & (1 << b)) r |= 1 << (bits - 1 - b);
+        }
+        conv->reverse[i] = r;
+    }
+
+    // transform the partitions, each zero padded to the transform size
+    for(long p = 0; p < conv->parts; p++){
+        long n = (length - p * size < size) ? length - p * size : size;
+        memset(part, 0, sizeof(float) * conv->fftsize);
+        memcpy(part, ir + p * size, sizeof(float) * n);
+        conv_spectrum(conv, part, conv->irre + p * conv->bins, conv->irim + p * conv->bins);
+    }
+
+    // start the workers, any that can't be started are summed by the caller
+    pthread_mutex_init(&conv->lock, NULL);
+    pthread_cond_init(&conv->go, NULL);
+    pthread_cond_init(&conv->done, NULL);
+    for(int i = 1; i < conv->threads; i++){
+        CONV_WORKER* worker = &conv->workers[conv->running + 1];
+        worker->conv = conv;
+        worker->index = i;
+        if(pthread_create(&worker->thread, NULL, conv_worker, worker) != 0)
+            break;
+        conv->running++;
+    }
+
+    return conv;
+}
+
+// convolve one block of input (size frames) into output
+void convolve_block(CONVOLVER* conv, float* input, float* output)
+{
+    int size = conv->size;
+    int bins = conv->bins;
+    float* re = conv->workre;
+    float* im = conv->workim;
+    float scale = 1.0 / conv->fftsize;
+
+    // overlap-save: transform the previous block followed by this one
+    memmove(conv->history, conv->history + size, sizeof(float) * size);
+    memcpy(conv->history + size, input, sizeof(float) * size);
+    conv->current = (conv->current + 1) % conv->parts;
+    conv_spectrum(conv, conv->history, conv->fdlre + conv->current * bins, conv->fdlim + conv->current * bins);
+
+    if(conv->running){
+        pthread_mutex_lock(&conv->lock);
+        conv->generation++;
+        conv->pending = conv->running;
+        pthread_cond_broadcast(&conv->go);
+        pthread_mutex_unlock(&conv->lock);
+    }
+    conv_accumulate(conv, 0);
+    for(int i = conv->running + 1; i < conv->threads; i++)
+        conv_accumulate(conv, i);
+    if(conv->running){
+        pthread_mutex_lock(&conv->lock);
+        while(conv->pending)
+            pthread_cond_wait(&conv->done, &conv->lock);
+        pthread_mutex_unlock(&conv->lock);
+    }
+    for(int i = 1; i < conv->threads; i++){
+        for(int k = 0; k < bins; k++){
+            conv->accre[k] += conv->accre[(long)i * conv->accstride + k];
+            conv->accim[k] += conv->accim[(long)i * conv->accstride + k];
+        }
+    }
+
+    // rebuild the mirrored half of the spectrum and transform back
+    for(int k = 0; k < bins; k++){
+        re[k] = conv->accre[k];
+        im[k] = conv->accim[k];
+    }
+    for(int k = bins; k < conv->fftsize; k++){
+        re[k] = re[conv->fftsize - k];
+        im[k] = -im[conv->fftsize - k];
+    }
+    conv_fft(conv, re, im, 1);
+    for(int i = 0; i < size; i++){
+        output[i] = re[size + i] * scale;
+    }
+}
+
+// destroy a convolver
+void destroy_convolver(CONVOLVER* conv)
+{
+    if(conv){
+        pthread_mutex_lock(&conv->lock);
+        conv->quit = 1;
+        pthread_cond_broadcast(&conv->go);
+        pthread_mutex_unlock(&conv->lock);
+        for(int i = 1; i <= conv->running; i++)
+            pthread_join(conv->workers[i].thread, NULL);
+        pthread_mutex_destroy(&conv->lock);
+        pthread_cond_destroy(&conv->go);
+        pthread_cond_destroy(&conv->done);
+        destroy_arena(conv->arena);
+    }
+}
+
+// estimate whether convolution beats the recursive network (1 = convolution)
+/*  Rough operation counts per frame: the recursive network is two reads, two
+    writes and the routing gains, while convolution pays two transforms per
+    block plus a complex multiply-add per bin and partition, shared between
+    the threads. Deriving the impulse response runs the recursion over its
+    length, which is only worth it if the input is long enough to win it back. */
+int convolution_is_faster(long irlength, long inputlength, int size, int threads)
+{
+    double fftsize = size * 2.0;
+    double parts = (double)((irlength + size - 1) / size);
+    double recursive = 16.0;
+    double transforms = 2.0 * 5.0 * fftsize * log2(fftsize) / size;
+    double multiply = 8.0 * parts * (size + 1) / size / (threads < parts ? threads : parts);
+    double direct = recursive * inputlength;
+    double convolved = (transforms + multiply) * inputlength + recursive * irlength;
+
+    return convolved < direct;
 }
\ No newline at end of file
@@ -1,16 +1,78 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include "arena.h"
+
+#define WEAVE_LINES (2)         // number of delay lines in the network
+#define DAMPING_STAGES (4)      // most biquads a damping cascade can hold
+#define PARAM_QUEUE_SIZE (256)  // parameter changes that can wait at once (a power of two)
+#define PARAM_RAMP (0.01)       // time (in seconds) a parameter takes to move to a new value
+
 // a simple delay block for testing
 typedef struct delay_block
 {
     long srate;                 // sample rate is used to calc delaytime
 
     unsigned long dtime;        // the delay time in samples
+    unsigned long capacity;     // room in the buffer (the longest dtime it can take)
     long writepos;              // the position of record head
     float* buffer;              // buffer to store the delay
 
     double input;               // trying this to build mixes within the delay block
     double output;
+
+    float floor;                // level at or below which a write counts as silence
+    unsigned long quiet;        // frames since something above the floor was written
+
+    ARENA* arena;               // set when the block has an arena of its own (see new_block)
 } BLOCK;
 
+// biquad coefficient names, see damping below
+enum biquad_coef {BQ_B0,BQ_B1,BQ_B2,BQ_A1,BQ_A2,BQ_NCOEFS};
+
+// damping filters in the feedback paths, one set per delay line
+/*  Everything is laid out [stage][line] so that each filter stage runs across
+    all of the delay lines in one loop. That loop is plain scalar code, one
+    frame at a time: with two lines there is nothing worth vectorizing, and
+    the feedback makes each frame depend on the last. Coefficients glide
+    towards their targets once per block instead of jumping. */
+typedef struct damping
+{
+    int active;                 // the filters are skipped until one is set
+    int running;                // set once blocks are processed, settings glide from then on
+    int stages;                 // biquads in use
+    double srate;
+
+    float pole[WEAVE_LINES];                            // one-pole lowpass
+    float poletarget[WEAVE_LINES];
+    float polestate[WEAVE_LINES];
+
+    float coef[BQ_NCOEFS][DAMPING_STAGES][WEAVE_LINES]; // biquad lowpass cascade
+    float target[BQ_NCOEFS][DAMPING_STAGES][WEAVE_LINES];
+    float z1[DAMPING_STAGES][WEAVE_LINES];
+    float z2[DAMPING_STAGES][WEAVE_LINES];
+} DAMPING;
+
+// the weave parameters that can be changed while audio is running
+enum weave_param {WP_GAIN_A,WP_GAIN_B,WP_A_TO_A,WP_B_TO_A,WP_A_TO_B,WP_B_TO_B,WP_NPARAMS};
+
+// a parameter change, to be applied at the block holding frame
+typedef struct param_change
+{
+    long frame;
+    int param;
+    double value;
+} PARAM_CHANGE;
+
+// single-producer/single-consumer ring of parameter changes
+/*  The control thread only ever moves head and the audio thread only ever
+    moves tail, so neither side takes a lock or waits on the other. */
+typedef struct param_queue
+{
+    PARAM_CHANGE changes[PARAM_QUEUE_SIZE];
+    _Alignas(ARENA_ALIGN) atomic_ulong head;   // changes sent so far (control thread)
+    _Alignas(ARENA_ALIGN) atomic_ulong tail;   // changes received so far (audio thread)
+} PARAM_QUEUE;
+
 typedef struct delay_network
 {
     BLOCK* delayA;              // building the delay blocks
@@ -30,6 +92,22 @@ typedef struct delay_network
     double feedbackfromBtoB;
     double delaytimeB;
 
+    // filters darkening what is fed back
+    DAMPING damping;
+
+    double floor;               // the noise floor, see weave_floor
+    int silent;                 // the network has been cleared by the silence gate
+
+    // parameter changes from a control thread, see weave_send
+    PARAM_QUEUE queue;
+    long clock;                 // frames processed so far
+    int ramp;                   // frames a change is spread over
+    double paramtarget[WP_NPARAMS];
+    double paramstep[WP_NPARAMS];
+    long paramleft[WP_NPARAMS]; // frames until a parameter reaches its target
+    int gliding;                // set while any parameter is still moving
+
+    ARENA* arena;               // the weave and its delay lines live in here
 } WEAVE;
 
 
@@ -58,4 +136,95 @@ void unravel(WEAVE* weave);
 float weave_tick(WEAVE* weave, float input);
 
 // push a default patch to the weave
-void weave_default(WEAVE* weave, int srate);
\ No newline at end of file
+void weave_default(WEAVE* weave, int srate);
+
+// set the damping of a delay line's feedback (cutoffs in Hz, 0 = off)
+void weave_damping(WEAVE* weave, int line, double cutoff, double lowpass, int stages);
+
+// block-rate housekeeping, call before each block of frames
+void weave_update(WEAVE* weave, long frames);
+
+// set the level (linear) below which the network counts as silent
+void weave_floor(WEAVE* weave, double floor);
+
+// look up a parameter by name (-1 if there is no such parameter)
+int weave_param_id(const char* name);
+
+// send a parameter change from the control thread, for the block holding frame (returns 1 if the queue is full)
+int weave_send(WEAVE* weave, int param, double value, long frame);
+
+// check if nothing above the noise floor is left in the network (1 = quiet)
+int weave_quiet(WEAVE* weave);
+
+// check if a block can be skipped, clearing the network the first time (1 = skip)
+int weave_gate(WEAVE* weave, float* input, long frames);
+
+// run a block through the network, mixing it half and half with the dry input
+void weave_process(WEAVE* weave, float* input, float* output, long frames);
+
+// flush denormals to zero on the calling thread
+void denormals_off(void);
+
+/************************ CONVOLUTION ENGINE ************************************/
+
+typedef struct convolver CONVOLVER;
+
+// one thread's share of the partitions
+typedef struct conv_worker
+{
+    CONVOLVER* conv;
+    int index;                  // which slice of the partitions this thread takes
+    _Alignas(ARENA_ALIGN) long generation;     // last block this thread summed (on a line of its own)
+    pthread_t thread;
+} CONV_WORKER;
+
+// uniformly partitioned overlap-save convolution
+struct convolver
+{
+    int size;                   // frames per partition (one processing block)
+    int fftsize;                // transform size (two partitions)
+    int bins;                   // bins kept from each spectrum (fftsize / 2 + 1)
+    long parts;                 // number of partitions in the impulse response
+    long current;               // slot of the newest input spectrum
+
+    float* irre;                // spectra of the impulse response partitions
+    float* irim;
+    float* fdlre;               // spectra of the past input blocks (frequency delay line)
+    float* fdlim;
+    float* accre;               // accumulated output spectrum, one per thread
+    float* accim;
+    long accstride;             // floats from one thread's spectrum to the next (whole cache lines)
+    float* history;             // the last two blocks of input
+    float* workre;              // transform scratch
+    float* workim;
+    float* twre;                // twiddle factors
+    float* twim;
+    int* reverse;               // bit reversal permutation
+
+    int threads;                // slices the partitions are split into
+    int running;                // worker threads actually started (slice 0 is the caller's)
+    CONV_WORKER* workers;
+    pthread_mutex_t lock;
+    pthread_cond_t go;          // signals the workers that a block is ready
+    pthread_cond_t done;        // signals the caller that all slices are summed
+    long generation;            // counts the blocks handed to the workers
+    int pending;                // workers still summing the current block
+    int quit;                   // tells the workers to finish
+
+    ARENA* arena;               // everything above lives in here
+};
+
+// derive the impulse response of the weave's current patch, cut where what's left adds up to threshold
+float* weave_impulse(WEAVE* weave, double threshold, long maxlen, long* length);
+
+// allocate a convolver for an impulse response with a block size and thread count
+CONVOLVER* new_convolver(float* ir, long length, int size, int threads);
+
+// convolve one block of input (size frames) into output
+void convolve_block(CONVOLVER* conv, float* input, float* output);
+
+// destroy a convolver
+void destroy_convolver(CONVOLVER* conv);
+
+// estimate whether convolution beats the recursive network (1 = convolution)
+int convolution_is_faster(long irlength, long inputlength, int size, int threads);
\ No newline at end of file